@@ -0,0 +1,249 @@
+// Checks the libcrunch C API directly, against plain GMP.
+// Covers argument checking, the hex and byte-buffer entry points, both ways of collecting rounds, and every table format.
+
+#include <gmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "crunch.h"
+
+#define STREAMS 6
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("FAIL line %i: %s\n", __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static gmp_randstate_t rng;
+
+static char* hex(mpz_t x) {
+	return mpz_get_str(NULL, 16, x);
+}
+
+// Writes x little-endian into buf, returning the byte count.
+static size_t to_bytes(unsigned char* buf, mpz_t x) {
+	size_t length;
+	mpz_export(buf, &length, -1, 1, 0, 0, x);
+	return length;
+}
+
+// Checks one subscription's result in a round, in both encodings.
+static void check_value(const crunch_round* result, size_t index, mpz_t expected) {
+	mpz_t got;
+	mpz_init(got);
+	mpz_set_str(got, crunch_round_value(result, index), 16);
+	CHECK(mpz_cmp(got, expected) == 0);
+	unsigned char buf[1024];
+	size_t length = crunch_round_value_bytes(result, index, NULL, 0);
+	CHECK(length == (mpz_sgn(expected) == 0 ? 0 : (mpz_sizeinbase(expected, 2) + 7) / 8));
+	CHECK(crunch_round_value_bytes(result, index, buf, length) == length);
+	mpz_import(got, length, -1, 1, 0, 0, buf);
+	CHECK(mpz_cmp(got, expected) == 0);
+	mpz_clear(got);
+}
+
+static void test_arguments() {
+	CHECK(crunch_engine_new(0, 0) == NULL);
+	CHECK(crunch_engine_new(1, 17) == NULL);
+	double mults = -1, bytes = -1;
+	CHECK(crunch_table_model(CRUNCH_TABLE_WINDOW, 4, 1, 0, 2048, &mults, &bytes) == CRUNCH_EINVAL);
+	CHECK(crunch_table_model(CRUNCH_TABLE_WINDOW, 17, 1, 2048, 2048, &mults, &bytes) == CRUNCH_EINVAL);
+	CHECK(crunch_table_model(3, 4, 1, 2048, 2048, &mults, &bytes) == CRUNCH_EINVAL);
+	CHECK(crunch_table_model(CRUNCH_TABLE_COMB, 4, 0, 2048, 2048, &mults, &bytes) == CRUNCH_EINVAL);
+	CHECK(mults == -1 && bytes == -1);
+	CHECK(crunch_table_model(CRUNCH_TABLE_WINDOW, 4, 1, 2048, 2048, &mults, &bytes) == CRUNCH_OK);
+	CHECK(mults > 0 && bytes > 0);
+
+	crunch_engine* engine = crunch_engine_new(2, 0);
+	CHECK(engine != NULL);
+	CHECK(crunch_set_default_table(engine, CRUNCH_TABLE_SIGNED, 0, 1) == CRUNCH_OK);
+	CHECK(crunch_set_default_table(engine, CRUNCH_TABLE_COMB, 4, 0) == CRUNCH_EINVAL);
+	CHECK(crunch_add_subscription(engine, 1, 0, "xyz") == CRUNCH_EINVAL);
+	CHECK(crunch_add_subscription(engine, 1, 0, "0") == CRUNCH_EINVAL);
+	CHECK(crunch_add_subscription(engine, 1, -1, "65") == CRUNCH_EINVAL);
+	CHECK(crunch_add_entry(engine, 1, 2, "3") == CRUNCH_ENOSUB);
+	CHECK(crunch_remove_subscription(engine, 1) == CRUNCH_ENOSUB);
+	CHECK(crunch_add_subscription(engine, 1, 0, "65") == CRUNCH_OK);
+	CHECK(crunch_add_entry_table(engine, 1, 2, "3", CRUNCH_TABLE_WINDOW, 17, 1) == CRUNCH_EINVAL);
+	CHECK(crunch_submit(engine, 2, 1, "-4") == CRUNCH_EINVAL);
+	CHECK(crunch_submit(engine, 2, 1, "q") == CRUNCH_EINVAL);
+	// An unused round completes right away, and empty.
+	crunch_round* result = crunch_collect_round(engine, 7);
+	CHECK(result != NULL && crunch_round_size(result) == 0);
+	crunch_round_free(result);
+	crunch_engine_free(engine);
+}
+
+// Runs a few rounds through an engine building the given table, submitting half of the datums as hex
+// and half as bytes, and checks them against mpz_powm.
+static void test_rounds(int format, int tradeoff, int comb_blocks, int exponent_bits) {
+	crunch_engine* engine = crunch_engine_new(3, 0);
+	CHECK(crunch_set_default_table(engine, format, tradeoff, comb_blocks) == CRUNCH_OK);
+	mpz_t modulus, bases[STREAMS], datums[STREAMS], expected, power;
+	mpz_inits(modulus, expected, power, NULL);
+	mpz_urandomb(modulus, rng, 512);
+	mpz_setbit(modulus, 511);
+	mpz_setbit(modulus, 0);
+	unsigned char buf[1024];
+	CHECK(crunch_add_subscription_bytes(engine, 5, exponent_bits, buf, to_bytes(buf, modulus)) == CRUNCH_OK);
+	for (int i = 0; i < STREAMS; i++) {
+		mpz_init(bases[i]);
+		mpz_init(datums[i]);
+		mpz_urandomm(bases[i], rng, modulus);
+		if (i % 2 == 0) {
+			char* base = hex(bases[i]);
+			CHECK(crunch_add_entry(engine, 5, 100 + i, base) == CRUNCH_OK);
+			free(base);
+		} else {
+			CHECK(crunch_add_entry_bytes(engine, 5, 100 + i, buf, to_bytes(buf, bases[i])) == CRUNCH_OK);
+		}
+	}
+	crunch_wait_for_tables(engine);
+	CHECK(crunch_pending_tables(engine) == 0);
+
+	for (uint64_t round = 0; round < 4; round++) {
+		// Zero, all ones, random, and (except in the first round) wider than the subscription's width.
+		uint64_t stream_ids[STREAMS];
+		char* hex_datums[STREAMS];
+		unsigned char* byte_datums[STREAMS];
+		const void* byte_pointers[STREAMS];
+		size_t lengths[STREAMS];
+		for (int i = 0; i < STREAMS; i++) {
+			stream_ids[i] = 100 + i;
+			if (i == 0) {
+				mpz_set_ui(datums[i], 0);
+			} else if (i == 1) {
+				mpz_set_ui(datums[i], 0);
+				mpz_setbit(datums[i], exponent_bits);
+				mpz_sub_ui(datums[i], datums[i], 1);
+			} else {
+				mpz_urandomb(datums[i], rng, round == 0 ? exponent_bits : exponent_bits + 64);
+			}
+			hex_datums[i] = hex(datums[i]);
+			byte_datums[i] = (unsigned char*)malloc(exponent_bits / 8 + 9);
+			byte_pointers[i] = byte_datums[i];
+			lengths[i] = to_bytes(byte_datums[i], datums[i]);
+		}
+		if (round % 2 == 0) {
+			CHECK(crunch_submit_many(engine, round, STREAMS, stream_ids, hex_datums) == CRUNCH_OK);
+		} else {
+			CHECK(crunch_submit_many_bytes(engine, round, STREAMS, stream_ids, byte_pointers, lengths) == CRUNCH_OK);
+		}
+		for (int i = 0; i < STREAMS; i++) {
+			free(hex_datums[i]);
+			free(byte_datums[i]);
+		}
+
+		mpz_set_ui(expected, 1);
+		for (int i = 0; i < STREAMS; i++) {
+			mpz_powm(power, bases[i], datums[i], modulus);
+			mpz_mul(expected, expected, power);
+			mpz_mod(expected, expected, modulus);
+		}
+		crunch_round* result = crunch_collect_round(engine, round);
+		CHECK(result != NULL && crunch_round_size(result) == 1 && crunch_round_sub_id(result, 0) == 5);
+		if (result != NULL && crunch_round_size(result) == 1)
+			check_value(result, 0, expected);
+		crunch_round_free(result);
+	}
+
+	char stats[1024];
+	CHECK(crunch_stats(engine, stats, sizeof stats) == (int)strlen(stats));
+	CHECK(crunch_remove_subscription(engine, 5) == CRUNCH_OK);
+	for (int i = 0; i < STREAMS; i++)
+		mpz_clears(bases[i], datums[i], NULL);
+	mpz_clears(modulus, expected, power, NULL);
+	crunch_engine_free(engine);
+}
+
+// Holds the single worker inside a round's callback, so that later rounds stay pending.
+// Callbacks on the worker post entered and wait for release; those run inline on the main thread post done.
+struct Gate {
+	pthread_t main_thread;
+	sem_t entered, release, done;
+	uint64_t last_round;
+	size_t last_size;
+};
+
+static void gate_callback(void* cookie, uint64_t round, crunch_round* result) {
+	Gate* gate = (Gate*)cookie;
+	gate->last_round = round;
+	gate->last_size = crunch_round_size(result);
+	crunch_round_free(result);
+	if (pthread_equal(pthread_self(), gate->main_thread)) {
+		sem_post(&gate->done);
+		return;
+	}
+	sem_post(&gate->entered);
+	sem_wait(&gate->release);
+}
+
+static void test_requests() {
+	crunch_engine* engine = crunch_engine_new(1, 0);
+	Gate gate;
+	gate.main_thread = pthread_self();
+	sem_init(&gate.entered, 0, 0);
+	sem_init(&gate.release, 0, 0);
+	sem_init(&gate.done, 0, 0);
+	// A 4096-bit exponentiation, so the round is nearly always requested before the worker gets to it.
+	mpz_t modulus;
+	mpz_init(modulus);
+	mpz_urandomb(modulus, rng, 4096);
+	mpz_setbit(modulus, 0);
+	char* m = hex(modulus);
+	CHECK(crunch_add_subscription(engine, 1, 0, m) == CRUNCH_OK);
+	CHECK(crunch_add_entry(engine, 1, 2, m + 1) == CRUNCH_OK);
+	uint64_t round = 0;
+	while (1) {
+		CHECK(crunch_submit(engine, 2, round, m + 1) == CRUNCH_OK);
+		CHECK(crunch_request_round(engine, round, gate_callback, &gate) == CRUNCH_OK);
+		// Unless the round was already done and delivered inline, the worker delivers it, and parks.
+		if (sem_trywait(&gate.done) != 0) {
+			sem_wait(&gate.entered);
+			break;
+		}
+		round++;
+	}
+	CHECK(gate.last_round == round && gate.last_size == 1);
+	// The next round can't be worked on, so it stays pending: a second request for it is refused.
+	round++;
+	CHECK(crunch_submit(engine, 2, round, "3") == CRUNCH_OK);
+	CHECK(crunch_request_round(engine, round, gate_callback, &gate) == CRUNCH_OK);
+	CHECK(crunch_request_round(engine, round, gate_callback, &gate) == CRUNCH_EBUSY);
+	CHECK(crunch_collect_round(engine, round) == NULL);
+	// Let the worker go; it finishes the pending round and parks again delivering it.
+	sem_post(&gate.release);
+	sem_wait(&gate.entered);
+	CHECK(gate.last_round == round && gate.last_size == 1);
+	sem_post(&gate.release);
+	free(m);
+	mpz_clear(modulus);
+	crunch_engine_free(engine);
+	sem_destroy(&gate.entered);
+	sem_destroy(&gate.release);
+	sem_destroy(&gate.done);
+}
+
+int main(int argc, char** argv) {
+	gmp_randinit_default(rng);
+	gmp_randseed_ui(rng, argc > 1 ? atoi(argv[1]) : 1);
+	test_arguments();
+	test_rounds(CRUNCH_TABLE_WINDOW, 0, 1, 512);
+	test_rounds(CRUNCH_TABLE_WINDOW, 4, 1, 512);
+	test_rounds(CRUNCH_TABLE_SIGNED, 5, 1, 300);
+	test_rounds(CRUNCH_TABLE_COMB, 4, 3, 512);
+	test_rounds(CRUNCH_TABLE_COMB, 3, 1000, 100);
+	// Too big a table to build: the entries still compute, without one.
+	test_rounds(CRUNCH_TABLE_WINDOW, 16, 1, 70000);
+	test_requests();
+	gmp_randclear(rng);
+	printf("%i failures\n", failures);
+	return failures != 0;
+}
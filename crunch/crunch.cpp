@@ -0,0 +1,1104 @@
+// === libcrunch ===
+// Copyright 2014, Peter Schmidt-Nielsen.
+// Licensed under the MIT license.
+//
+// The subscription/entry/computation engine, factored out of the cruncher so it can be used in-process.
+// See crunch.h for the API.
+//
+// The computation is performed by a pool of worker threads, each of which owns one job slot.
+// The calling thread hands out jobs by waiting on workers_ready, claiming a free slot, filling it
+// in, and posting that slot's job_described semaphore.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <gmp.h>
+
+using namespace std;
+#include <vector>
+#include <map>
+
+#include "crunch.h"
+
+typedef uint64_t RoundNum;
+typedef uint64_t SubId;
+typedef uint64_t StreamId;
+
+struct Subscription;
+struct Entry;
+struct Computation;
+
+typedef enum {
+	JOB_NONE,
+	JOB_COMP,
+	JOB_REBUILD,
+	JOB_EXIT,
+} jobtype_t;
+
+// Which kind of acceleration table to build, and how big.
+struct TableSpec {
+	int format;
+	// Bits per window for CRUNCH_TABLE_WINDOW and CRUNCH_TABLE_SIGNED, or teeth for CRUNCH_TABLE_COMB.
+	// Zero disables the precomputed table mode entirely.
+	int tradeoff;
+	// Only used by CRUNCH_TABLE_COMB.
+	int comb_blocks;
+
+	bool operator==(const TableSpec& other) const {
+		return format == other.format && tradeoff == other.tradeoff && comb_blocks == other.comb_blocks;
+	}
+};
+
+// Running totals over the installed tables of one format, for crunch_stats.
+struct TableStats {
+	int tables;
+	double bytes;
+	// Summed modelled multiplications per exponentiation, to be averaged over tables.
+	double mults;
+};
+
+static bool valid_table_spec(TableSpec spec) {
+	if (spec.format != CRUNCH_TABLE_WINDOW && spec.format != CRUNCH_TABLE_SIGNED && spec.format != CRUNCH_TABLE_COMB)
+		return false;
+	return spec.tradeoff >= 0 && spec.tradeoff <= 16 && spec.comb_blocks >= 1 && spec.comb_blocks <= 65536;
+}
+
+// The most powers one table may hold. This admits 16-bit windows on 16384-bit exponents (about 2^26 powers),
+// and keeps every table index within an int.
+#define MAX_TABLE_LENGTH ((int64_t)1 << 26)
+
+// Tracks when a round is finished, and who to tell about it.
+struct RoundState {
+	// The number of datums submitted to the round that no worker has finished with yet.
+	int pending;
+	// Set once the round's results have been requested. The round finishes when this is set and pending is zero.
+	bool requested;
+	crunch_round_callback callback;
+	void* cookie;
+};
+
+struct JobSlot {
+	StreamId stream_id;
+	RoundNum round_number;
+	SubId sub_id;
+	mpz_t datum;
+	jobtype_t type;
+	sem_t job_described;
+	bool ready_for_job;
+};
+
+// Everything that used to live in the cruncher's global namespace.
+struct crunch_engine {
+	int thread_count;
+	// The table built for entries added without an explicit format.
+	TableSpec default_table;
+	// Indexed by CRUNCH_TABLE_* format, and guarded by globals_rwlock.
+	TableStats table_stats[3];
+	// Maps subscription number to a subscription.
+	map<SubId, Subscription*> subscriptions;
+	// Maps a round and subid to a computation object.
+	map<RoundNum, map<SubId, Computation*>> computations;
+	// Maps a round to its completion bookkeeping.
+	map<RoundNum, RoundState> rounds;
+	// Guards rounds and computations. It is only ever held for map lookups, never across an exponentiation,
+	// so submitting and requesting rounds never wait on the workers. Taken after globals_rwlock, if both are.
+	pthread_mutex_t rounds_mutex;
+	// The number of table rebuild jobs issued that no worker has finished yet, guarded by rebuilds_mutex.
+	int pending_rebuilds;
+	pthread_mutex_t rebuilds_mutex;
+	pthread_cond_t rebuilds_cond;
+	// Data used for communication between the workers and the calling thread.
+	JobSlot* job_slots;
+	pthread_t* threads;
+	// This lock synchronizes reads and writes to subscriptions, their entries and tables, and the table stats.
+	// Workers hold it for reading throughout their exponentiations, so it is only ever written to change a subscription.
+	pthread_rwlock_t globals_rwlock;
+	// Counts the job slots that are free to be handed a new job.
+	sem_t workers_ready;
+	// Scratch space for parsing numbers handed in on the calling thread.
+	mpz_t temp_mpz;
+};
+
+#define READ_LOCK_GLOBALS(e) pthread_rwlock_rdlock(&(e)->globals_rwlock)
+#define WRITE_LOCK_GLOBALS(e) pthread_rwlock_wrlock(&(e)->globals_rwlock)
+#define UNLOCK_GLOBALS(e) pthread_rwlock_unlock(&(e)->globals_rwlock)
+
+struct crunch_round {
+	vector<SubId> sub_ids;
+	// One result per subscription. Their hex forms are only rendered if asked for.
+	mpz_t* numbers;
+	mutable vector<char*> values;
+
+	crunch_round(size_t count) : sub_ids(count), numbers(new mpz_t[count]), values(count, NULL) {
+		for (size_t i = 0; i < count; i++)
+			mpz_init(numbers[i]);
+	}
+
+	~crunch_round() {
+		// mpz_get_str allocates with GMP's allocator, which is malloc unless overridden.
+		void (*gmp_free)(void*, size_t);
+		mp_get_memory_functions(NULL, NULL, &gmp_free);
+		for (size_t i = 0; i < sub_ids.size(); i++) {
+			mpz_clear(numbers[i]);
+			if (values[i] != NULL)
+				gmp_free(values[i], strlen(values[i]) + 1);
+		}
+		delete[] numbers;
+	}
+};
+
+struct Subscription {
+	crunch_engine* engine;
+	mpz_t modulus;
+	// The width of the exponents (datums) this subscription expects, which sizes its entries' tables.
+	int bits_per_field;
+	// Maps stream number to an entry.
+	map<StreamId, Entry*> entries;
+
+	Subscription(crunch_engine* engine, mpz_t _modulus, int bits_per_field) : engine(engine), bits_per_field(bits_per_field) {
+		mpz_init_set(modulus, _modulus);
+	}
+
+	~Subscription();
+};
+
+// Extracts width bits of x starting at bit offset, without modifying x.
+static inline mp_limb_t get_bits(const mpz_t x, int offset, int width) {
+	int limb = offset / GMP_NUMB_BITS;
+	int shift = offset % GMP_NUMB_BITS;
+	mp_limb_t bits = mpz_getlimbn(x, limb) >> shift;
+	if (shift + width > GMP_NUMB_BITS)
+		bits |= mpz_getlimbn(x, limb + 1) << (GMP_NUMB_BITS - shift);
+	return bits & (((mp_limb_t)1 << width) - 1);
+}
+
+// A precomputed table of powers of one base, in one of the CRUNCH_TABLE_* layouts.
+//   Window: ceil(bits / w) chunks, each holding x^1 .. x^(2^w - 1), where x = base^(2^(w*chunk)).
+//   Signed: the same chunks, each holding only x^1 .. x^(2^(w-1)), plus one final power for the last carry.
+//     Digits above 2^(w-1) are recoded as negative, and their powers go into a separate denominator.
+//   Comb: Lim-Lee with h teeth spaced a = ceil(bits / h) apart, split into v blocks of b = ceil(a / v) columns.
+//     Block j holds, for every non-zero h bit pattern I, the product of base^(2^(k*a + j*b)) over the bits k of I.
+struct Table {
+	TableSpec spec;
+	int bits_per_field;
+	int length;
+	mpz_t* powers;
+
+	// Computed in 64 bits, as wide subscriptions with wide windows overflow an int; see MAX_TABLE_LENGTH.
+	static int64_t get_table_length(TableSpec spec, int bits_per_field) {
+		int w = spec.tradeoff;
+		int64_t chunks = (bits_per_field + w - 1) / w;
+		switch (spec.format) {
+			case CRUNCH_TABLE_WINDOW:
+				return chunks * ((1 << w) - 1);
+			case CRUNCH_TABLE_SIGNED:
+				return chunks * (1 << (w - 1)) + 1;
+			case CRUNCH_TABLE_COMB:
+				return (int64_t)get_comb_blocks(spec, bits_per_field) * ((1 << w) - 1);
+		}
+		return 0;
+	}
+
+	// More blocks than columns would just store duplicate powers, so clamp.
+	static int get_comb_blocks(TableSpec spec, int bits_per_field) {
+		int a = (bits_per_field + spec.tradeoff - 1) / spec.tradeoff;
+		return spec.comb_blocks < a ? spec.comb_blocks : a;
+	}
+
+	Table(TableSpec spec, int bits_per_field, mpz_t base, mpz_t modulus) : spec(spec), bits_per_field(bits_per_field) {
+		length = (int)get_table_length(spec, bits_per_field);
+		powers = new mpz_t[length];
+		for (int i = 0; i < length; i++)
+			mpz_init(powers[i]);
+		if (spec.format == CRUNCH_TABLE_COMB)
+			build_comb(base, modulus);
+		else
+			build_windows(base, modulus);
+	}
+
+	~Table() {
+		for (int i = 0; i < length; i++)
+			mpz_clear(powers[i]);
+		delete[] powers;
+	}
+
+	void build_windows(mpz_t base, mpz_t modulus) {
+		int w = spec.tradeoff;
+		int chunks = (bits_per_field + w - 1) / w;
+		int nums_per_chunk = spec.format == CRUNCH_TABLE_SIGNED ? 1 << (w - 1) : (1 << w) - 1;
+		mpz_t x;
+		mpz_init_set(x, base);
+		for (int chunk = 0; chunk < chunks; chunk++) {
+			mpz_t* y = powers + chunk*nums_per_chunk;
+			mpz_set(y[0], x);
+			for (int i = 1; i < nums_per_chunk; i++) {
+				mpz_mul(y[i], y[i-1], x);
+				mpz_mod(y[i], y[i], modulus);
+			}
+			// Advance x by tradeoff bits.
+			mpz_powm_ui(x, x, 1 << w, modulus);
+		}
+		if (spec.format == CRUNCH_TABLE_SIGNED)
+			mpz_set(powers[length - 1], x);
+		mpz_clear(x);
+	}
+
+	void build_comb(mpz_t base, mpz_t modulus) {
+		int h = spec.tradeoff;
+		int a = (bits_per_field + h - 1) / h;
+		int v = get_comb_blocks(spec, bits_per_field);
+		int b = (a + v - 1) / v;
+		int nums_per_block = (1 << h) - 1;
+		// The first block is built from the powers base^(2^(k*a)), one per tooth.
+		mpz_t shift;
+		mpz_init(shift);
+		mpz_setbit(shift, a);
+		mpz_t* teeth = new mpz_t[h];
+		for (int k = 0; k < h; k++) {
+			mpz_init(teeth[k]);
+			if (k == 0)
+				mpz_set(teeth[k], base);
+			else
+				mpz_powm(teeth[k], teeth[k-1], shift, modulus);
+		}
+		for (int pattern = 1; pattern <= nums_per_block; pattern++) {
+			int top = 31 - __builtin_clz(pattern);
+			int rest = pattern ^ (1 << top);
+			if (rest == 0) {
+				mpz_set(powers[pattern - 1], teeth[top]);
+			} else {
+				mpz_mul(powers[pattern - 1], powers[rest - 1], teeth[top]);
+				mpz_mod(powers[pattern - 1], powers[pattern - 1], modulus);
+			}
+		}
+		for (int k = 0; k < h; k++)
+			mpz_clear(teeth[k]);
+		delete[] teeth;
+		// Each further block is the previous one shifted up by b columns.
+		mpz_set_ui(shift, 0);
+		mpz_setbit(shift, b);
+		for (int j = 1; j < v; j++)
+			for (int i = 0; i < nums_per_block; i++)
+				mpz_powm(powers[j*nums_per_block + i], powers[(j-1)*nums_per_block + i], shift, modulus);
+		mpz_clear(shift);
+	}
+
+	// Computes base^datum as dest / dest_inverse, so that signed digits never need an inversion here.
+	// dest_inverse is set to one by the unsigned formats.
+	void exponentiate(mpz_t dest, mpz_t dest_inverse, mpz_t datum, mpz_t modulus) {
+		mpz_set_ui(dest, 1);
+		mpz_set_ui(dest_inverse, 1);
+		int w = spec.tradeoff;
+		if (spec.format == CRUNCH_TABLE_WINDOW) {
+			int chunks = (bits_per_field + w - 1) / w;
+			int nums_per_chunk = (1 << w) - 1;
+			for (int chunk = 0; chunk < chunks; chunk++) {
+				mp_limb_t bits = get_bits(datum, chunk * w, w);
+				if (bits != 0) {
+					// Multiply in the appropriate table entry.
+					// The subtraction of 1 is because we don't need a table entry for the zero bit pattern.
+					mpz_mul(dest, dest, powers[chunk*nums_per_chunk + bits - 1]);
+					mpz_mod(dest, dest, modulus);
+				}
+			}
+		} else if (spec.format == CRUNCH_TABLE_SIGNED) {
+			int chunks = (bits_per_field + w - 1) / w;
+			int nums_per_chunk = 1 << (w - 1);
+			long carry = 0;
+			for (int chunk = 0; chunk < chunks; chunk++) {
+				long digit = get_bits(datum, chunk * w, w) + carry;
+				// Recode the top half of the digit range as negative digits, borrowing from the next chunk.
+				carry = digit > nums_per_chunk;
+				if (carry)
+					digit -= 1 << w;
+				if (digit > 0) {
+					mpz_mul(dest, dest, powers[chunk*nums_per_chunk + digit - 1]);
+					mpz_mod(dest, dest, modulus);
+				} else if (digit < 0) {
+					mpz_mul(dest_inverse, dest_inverse, powers[chunk*nums_per_chunk - digit - 1]);
+					mpz_mod(dest_inverse, dest_inverse, modulus);
+				}
+			}
+			if (carry) {
+				mpz_mul(dest, dest, powers[length - 1]);
+				mpz_mod(dest, dest, modulus);
+			}
+		} else {
+			int h = w;
+			int a = (bits_per_field + h - 1) / h;
+			int v = get_comb_blocks(spec, bits_per_field);
+			int b = (a + v - 1) / v;
+			int nums_per_block = (1 << h) - 1;
+			for (int t = b - 1; t >= 0; t--) {
+				if (t != b - 1) {
+					mpz_mul(dest, dest, dest);
+					mpz_mod(dest, dest, modulus);
+				}
+				for (int j = v - 1; j >= 0; j--) {
+					int column = j*b + t;
+					if (column >= a)
+						continue;
+					// Gather one bit from under each tooth.
+					int pattern = 0;
+					for (int k = 0; k < h; k++)
+						pattern |= mpz_tstbit(datum, k*a + column) << k;
+					if (pattern != 0) {
+						mpz_mul(dest, dest, powers[j*nums_per_block + pattern - 1]);
+						mpz_mod(dest, dest, modulus);
+					}
+				}
+			}
+		}
+	}
+};
+
+// Estimates the modular multiplications per exponentiation and the table size for a spec. See crunch_table_model.
+static void model_table(TableSpec spec, int exponent_bits, int modulus_bits, double* mults, double* bytes) {
+	if (spec.tradeoff == 0) {
+		// Vanilla mpz_powm: a squaring per bit, plus GMP's sliding windows, which cost one multiplication
+		// per w + 1 bits and 2^(w-1) more to build the odd powers. w grows with the exponent's width, at the
+		// same thresholds GMP's mpn_powm uses.
+		static const int window_thresholds[] = {7, 25, 81, 241, 673, 1793, 4609, 11521, 28161};
+		int w = 1;
+		while (w <= 9 && exponent_bits > window_thresholds[w - 1])
+			w++;
+		*mults = exponent_bits * (1.0 + 1.0 / (w + 1)) + (1 << (w - 1));
+		*bytes = 0;
+		return;
+	}
+	int chunks = (exponent_bits + spec.tradeoff - 1) / spec.tradeoff;
+	// Each window is zero, and costs nothing, with probability 2^-w.
+	double nonzero = 1.0 - 1.0 / (1 << spec.tradeoff);
+	if (spec.format == CRUNCH_TABLE_COMB) {
+		// There are a = chunks columns, walked b at a time with one squaring between steps.
+		int v = Table::get_comb_blocks(spec, exponent_bits);
+		int b = (chunks + v - 1) / v;
+		*mults = (b - 1) + chunks * nonzero;
+	} else {
+		*mults = chunks * nonzero;
+	}
+	double limbs = (modulus_bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+	*bytes = Table::get_table_length(spec, exponent_bits) * (limbs * sizeof(mp_limb_t) + sizeof(mpz_t));
+}
+
+struct Entry {
+	mpz_t base;
+	// The table this entry should have, and the one it has right now (NULL until the first is built).
+	TableSpec wanted;
+	Table* table;
+	Subscription* parent;
+
+	Entry(Subscription* parent, mpz_t _base, TableSpec wanted) : wanted(wanted), table(NULL), parent(parent) {
+		mpz_init_set(base, _base);
+	}
+
+	~Entry() {
+		mpz_clear(base);
+		install_table(NULL);
+	}
+
+	// Swaps in a new table (or none), and keeps the engine's statistics in step.
+	// Must be called with the globals write locked.
+	void install_table(Table* new_table);
+
+	void exponentiate(mpz_t dest, mpz_t dest_inverse, mpz_t datum) {
+//		gmp_printf("Exponentiating: %Zd ** %Zd mod %Zd\n", base, datum, parent->modulus);
+		// If no table is built, run a vanilla modular exponentiation.
+		// Likewise for datums wider than the subscription declared, which the table cannot cover.
+		if (table == NULL || mpz_sizeinbase(datum, 2) > (size_t)table->bits_per_field) {
+			mpz_powm(dest, base, datum, parent->modulus);
+			mpz_set_ui(dest_inverse, 1);
+			return;
+		}
+		// Otherwise, let's use our table.
+		table->exponentiate(dest, dest_inverse, datum, parent->modulus);
+	}
+
+};
+
+Subscription::~Subscription() {
+	// The entries go first, as taking down their tables' stats reads the modulus.
+	for (auto it = entries.begin(); it != entries.end(); it++) {
+		delete it->second;
+	}
+	mpz_clear(modulus);
+}
+
+void Entry::install_table(Table* new_table) {
+	TableStats* stats = parent->engine->table_stats;
+	double mults, bytes;
+	if (table != NULL) {
+		model_table(table->spec, table->bits_per_field, mpz_sizeinbase(parent->modulus, 2), &mults, &bytes);
+		stats[table->spec.format].tables--;
+		stats[table->spec.format].bytes -= bytes;
+		stats[table->spec.format].mults -= mults;
+		delete table;
+	}
+	table = new_table;
+	if (table != NULL) {
+		model_table(table->spec, table->bits_per_field, mpz_sizeinbase(parent->modulus, 2), &mults, &bytes);
+		stats[table->spec.format].tables++;
+		stats[table->spec.format].bytes += bytes;
+		stats[table->spec.format].mults += mults;
+	}
+}
+
+struct Computation {
+	Subscription* sub;
+	int thread_count;
+	mpz_t* accums;
+	// Per-thread products of the powers that signed-digit tables owe as divisors.
+	mpz_t* inverse_accums;
+	int pending_computations;
+
+	Computation(Subscription* sub, int thread_count) : sub(sub), thread_count(thread_count), pending_computations(0) {
+		// Allocate one accumulator per thread, so that multiple threads can work on the computation at the same time.
+		// In the end, the answer is the product of these accumulators.
+		accums = new mpz_t[thread_count];
+		inverse_accums = new mpz_t[thread_count];
+		for (int i = 0; i < thread_count; i++) {
+			mpz_init_set_ui(accums[i], 1);
+			mpz_init_set_ui(inverse_accums[i], 1);
+		}
+	}
+
+	~Computation() {
+		for (int i = 0; i < thread_count; i++) {
+			mpz_clear(accums[i]);
+			mpz_clear(inverse_accums[i]);
+		}
+		delete[] accums;
+		delete[] inverse_accums;
+	}
+
+	void process_datum(int thread_index, StreamId stream, mpz_t datum) {
+		// Streams without an entry in this subscription are zeros in the (sparse) matrix, and contribute nothing.
+		auto found = sub->entries.find(stream);
+		if (found == sub->entries.end())
+			return;
+		mpz_t local, local_inverse;
+		mpz_init(local);
+		mpz_init(local_inverse);
+		found->second->exponentiate(local, local_inverse, datum);
+//		gmp_printf("Computed additional: %Zd\n", local);
+		mpz_mul(accums[thread_index], accums[thread_index], local);
+		mpz_mod(accums[thread_index], accums[thread_index], sub->modulus);
+		if (mpz_cmp_ui(local_inverse, 1) != 0) {
+			mpz_mul(inverse_accums[thread_index], inverse_accums[thread_index], local_inverse);
+			mpz_mod(inverse_accums[thread_index], inverse_accums[thread_index], sub->modulus);
+		}
+		mpz_clear(local);
+		mpz_clear(local_inverse);
+	}
+
+	void produce_result(mpz_t output) {
+		mpz_t divisor;
+		mpz_init_set_ui(divisor, 1);
+		mpz_set_ui(output, 1);
+		// Multiply all the thread-specific accumulators together.
+		for (int i = 0; i < thread_count; i++) {
+			mpz_mul(output, output, accums[i]);
+			mpz_mod(output, output, sub->modulus);
+			mpz_mul(divisor, divisor, inverse_accums[i]);
+			mpz_mod(divisor, divisor, sub->modulus);
+		}
+		// Signed-digit tables defer all their divisions to here, costing one inversion per round.
+		// Their bases are checked to be invertible when the table is built, so this cannot fail.
+		if (mpz_cmp_ui(divisor, 1) != 0) {
+			mpz_invert(divisor, divisor, sub->modulus);
+			mpz_mul(output, output, divisor);
+			mpz_mod(output, output, sub->modulus);
+		}
+		mpz_clear(divisor);
+	}
+};
+
+// Finds an entry by ID. Must be called with the globals locked.
+static Entry* find_entry(crunch_engine* engine, SubId sub_id, StreamId stream_id) {
+	auto sub = engine->subscriptions.find(sub_id);
+	if (sub == engine->subscriptions.end())
+		return NULL;
+	auto entry = sub->second->entries.find(stream_id);
+	if (entry == sub->second->entries.end())
+		return NULL;
+	return entry->second;
+}
+
+// Builds an entry's table off to the side, then swaps it in under the write lock, so that computations
+// running concurrently never see a half built table. The entry is looked up again before installing,
+// as it may have been replaced or removed in the meantime; if its parameters changed, the table is discarded.
+static void rebuild_entry_table(crunch_engine* engine, SubId sub_id, StreamId stream_id) {
+	mpz_t base, modulus;
+	READ_LOCK_GLOBALS(engine);
+	Entry* entry = find_entry(engine, sub_id, stream_id);
+	if (entry == NULL) {
+		UNLOCK_GLOBALS(engine);
+		return;
+	}
+	mpz_init_set(base, entry->base);
+	mpz_init_set(modulus, entry->parent->modulus);
+	int bits_per_field = entry->parent->bits_per_field;
+	TableSpec wanted = entry->wanted;
+	UNLOCK_GLOBALS(engine);
+
+	// Signed digits are paid for with an inversion at the end of the round, which needs an invertible base.
+	// Bases sharing a factor with the modulus fall back to plain windows of the same width.
+	TableSpec spec = wanted;
+	if (spec.format == CRUNCH_TABLE_SIGNED) {
+		mpz_t gcd;
+		mpz_init(gcd);
+		mpz_gcd(gcd, base, modulus);
+		if (mpz_cmp_ui(gcd, 1) != 0)
+			spec.format = CRUNCH_TABLE_WINDOW;
+		mpz_clear(gcd);
+	}
+	// A tradeoff value of zero disables the precomputed table mode.
+	Table* new_table = NULL;
+	if (spec.tradeoff != 0)
+		new_table = new Table(spec, bits_per_field, base, modulus);
+
+	WRITE_LOCK_GLOBALS(engine);
+	entry = find_entry(engine, sub_id, stream_id);
+	if (entry != NULL && entry->wanted == wanted && entry->parent->bits_per_field == bits_per_field &&
+		mpz_cmp(entry->base, base) == 0 && mpz_cmp(entry->parent->modulus, modulus) == 0) {
+		entry->install_table(new_table);
+		new_table = NULL;
+	}
+	UNLOCK_GLOBALS(engine);
+
+	delete new_table;
+	mpz_clear(base);
+	mpz_clear(modulus);
+}
+
+// Collects a round's results, and releases its storage. Must be called with the globals read locked,
+// which keeps the computations' subscriptions alive, and rounds_mutex held, which is dropped before the
+// (slow) results are produced.
+static crunch_round* take_round_results(crunch_engine* engine, RoundNum round_number) {
+	map<SubId, Computation*> comps;
+	auto found = engine->computations.find(round_number);
+	if (found != engine->computations.end()) {
+		comps.swap(found->second);
+		engine->computations.erase(found);
+	}
+	pthread_mutex_unlock(&engine->rounds_mutex);
+	crunch_round* result = new crunch_round(comps.size());
+	size_t i = 0;
+	for (auto it = comps.begin(); it != comps.end(); it++, i++) {
+		it->second->produce_result(result->numbers[i]);
+		result->sub_ids[i] = it->first;
+		// Delete the allocation as we go, as we're done with the round.
+		delete it->second;
+	}
+	return result;
+}
+
+// Delivers a requested round whose last datum has been processed.
+// More datums may have been submitted to the round since the caller saw it finish, or another thread may
+// have beaten us to delivering it, so check again under rounds_mutex.
+static void finish_round(crunch_engine* engine, RoundNum round_number) {
+	READ_LOCK_GLOBALS(engine);
+	pthread_mutex_lock(&engine->rounds_mutex);
+	auto found = engine->rounds.find(round_number);
+	if (found == engine->rounds.end() || found->second.pending != 0 || !found->second.requested) {
+		pthread_mutex_unlock(&engine->rounds_mutex);
+		UNLOCK_GLOBALS(engine);
+		return;
+	}
+	RoundState state = found->second;
+	engine->rounds.erase(found);
+	crunch_round* result = take_round_results(engine, round_number);
+	UNLOCK_GLOBALS(engine);
+	// Call out with no locks held, so slow callbacks only hold up this one worker.
+	state.callback(state.cookie, round_number, result);
+}
+
+struct WorkerCookie {
+	crunch_engine* engine;
+	int thread_index;
+};
+
+static void* process_thread(void* cookie) {
+	crunch_engine* engine = ((WorkerCookie*)cookie)->engine;
+	int thread_index = ((WorkerCookie*)cookie)->thread_index;
+	delete (WorkerCookie*)cookie;
+	mpz_t datum;
+	mpz_init(datum);
+
+	while (1) {
+		// Grab a job in our slot.
+		sem_wait(&engine->job_slots[thread_index].job_described);
+		// Read in the job.
+		JobSlot& js = engine->job_slots[thread_index];
+		SubId sub_id = js.sub_id;
+		StreamId stream_id = js.stream_id;
+		RoundNum round_number = js.round_number;
+		jobtype_t type = js.type;
+		if (type == JOB_COMP)
+			mpz_set(datum, js.datum);
+		if (type == JOB_EXIT)
+			break;
+//		gmp_printf("Starting job: stream=%i round=%i datum=%Zd\n", stream_id, round_number, datum);
+		// Tell the calling thread that we're done reading in the job description.
+		js.ready_for_job = true;
+		sem_post(&engine->workers_ready);
+
+		if (type == JOB_COMP) {
+			READ_LOCK_GLOBALS(engine);
+//			gmp_printf("Computing in thread: %i\n", thread_index);
+			// Feed the datum to the computation of every subscription that is live now.
+			// The computations can't be deleted under us: the round can't finish while this datum is pending,
+			// and dropping a subscription takes the globals write lock.
+			pthread_mutex_lock(&engine->rounds_mutex);
+			map<SubId, Computation*>& round_comps = engine->computations.find(round_number)->second;
+			vector<Computation*> comps;
+			for (auto it = round_comps.begin(); it != round_comps.end(); it++)
+				comps.push_back(it->second);
+			pthread_mutex_unlock(&engine->rounds_mutex);
+			for (size_t i = 0; i < comps.size(); i++)
+				comps[i]->process_datum(thread_index, stream_id, datum);
+			pthread_mutex_lock(&engine->rounds_mutex);
+			RoundState& state = engine->rounds.find(round_number)->second;
+			bool round_done = --state.pending == 0 && state.requested;
+			pthread_mutex_unlock(&engine->rounds_mutex);
+			UNLOCK_GLOBALS(engine);
+			// If that was the last datum of a requested round, this thread delivers the results.
+			if (round_done)
+				finish_round(engine, round_number);
+		} else if (type == JOB_REBUILD) {
+//			gmp_printf("Rebuilding sub=%i stream=%i in thread: %i\n", sub_id, stream_id, thread_index);
+			rebuild_entry_table(engine, sub_id, stream_id);
+			pthread_mutex_lock(&engine->rebuilds_mutex);
+			if (--engine->pending_rebuilds == 0)
+				pthread_cond_broadcast(&engine->rebuilds_cond);
+			pthread_mutex_unlock(&engine->rebuilds_mutex);
+		}
+	}
+
+	mpz_clear(datum);
+	return NULL;
+}
+
+// Waits for a ready worker, and claims its job slot. The caller fills in the slot, then posts job_described.
+static JobSlot& claim_job_slot(crunch_engine* engine) {
+	sem_wait(&engine->workers_ready);
+	for (int i = 0; i < engine->thread_count; i++) {
+		JobSlot& js = engine->job_slots[i];
+		if (js.ready_for_job) {
+			js.ready_for_job = false;
+			return js;
+		}
+	}
+	assert("BUGBUGBUG: workers_ready semaphore was non-empty when no slot was free!" == NULL);
+	abort();
+}
+
+crunch_engine* crunch_engine_new(int thread_count, int default_tradeoff) {
+	// Reject anything outside some (extremely generous) range limits.
+	if (thread_count < 1 || thread_count > 1024)
+		return NULL;
+	TableSpec default_table = {CRUNCH_TABLE_WINDOW, default_tradeoff, 1};
+	if (!valid_table_spec(default_table))
+		return NULL;
+
+	crunch_engine* engine = new crunch_engine;
+	engine->thread_count = thread_count;
+	engine->default_table = default_table;
+	memset(engine->table_stats, 0, sizeof engine->table_stats);
+	engine->pending_rebuilds = 0;
+	mpz_init(engine->temp_mpz);
+
+	// These are checked by hand rather than with assert, as embedders may well build with NDEBUG.
+	// On failure, whatever was set up so far is torn down in reverse, and NULL is returned.
+	int slots = 0, threads = 0;
+	if (sem_init(&engine->workers_ready, 0, thread_count) != 0)
+		goto free_engine;
+	if (pthread_rwlock_init(&engine->globals_rwlock, NULL) != 0)
+		goto destroy_workers_ready;
+	if (pthread_mutex_init(&engine->rounds_mutex, NULL) != 0)
+		goto destroy_globals_rwlock;
+	if (pthread_mutex_init(&engine->rebuilds_mutex, NULL) != 0)
+		goto destroy_rounds_mutex;
+	if (pthread_cond_init(&engine->rebuilds_cond, NULL) != 0)
+		goto destroy_rebuilds_mutex;
+
+	// Construct the job slot structure.
+	// This consists of one semaphore and one flag per job slot.
+	// Each thread waits on its job slot's semaphore.
+	// When triggered, it reads the job in, marks its slot ready again, and posts workers_ready.
+	engine->job_slots = new JobSlot[thread_count];
+	for (; slots < thread_count; slots++) {
+		if (sem_init(&engine->job_slots[slots].job_described, 0, 0) != 0)
+			goto destroy_job_slots;
+		engine->job_slots[slots].ready_for_job = true;
+		mpz_init(engine->job_slots[slots].datum);
+	}
+
+	// Spawn worker threads.
+	engine->threads = new pthread_t[thread_count];
+	for (; threads < thread_count; threads++) {
+		WorkerCookie* cookie = new WorkerCookie{engine, threads};
+		if (pthread_create(&engine->threads[threads], NULL, process_thread, (void*)cookie) != 0) {
+			delete cookie;
+			goto stop_threads;
+		}
+	}
+	return engine;
+
+	stop_threads:
+	// Nothing has claimed a slot yet, so each running worker can be handed an exit job in its own slot.
+	for (int i = 0; i < threads; i++) {
+		engine->job_slots[i].type = JOB_EXIT;
+		sem_post(&engine->job_slots[i].job_described);
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join(engine->threads[i], NULL);
+	delete[] engine->threads;
+	destroy_job_slots:
+	for (int i = 0; i < slots; i++) {
+		sem_destroy(&engine->job_slots[i].job_described);
+		mpz_clear(engine->job_slots[i].datum);
+	}
+	delete[] engine->job_slots;
+	pthread_cond_destroy(&engine->rebuilds_cond);
+	destroy_rebuilds_mutex:
+	pthread_mutex_destroy(&engine->rebuilds_mutex);
+	destroy_rounds_mutex:
+	pthread_mutex_destroy(&engine->rounds_mutex);
+	destroy_globals_rwlock:
+	pthread_rwlock_destroy(&engine->globals_rwlock);
+	destroy_workers_ready:
+	sem_destroy(&engine->workers_ready);
+	free_engine:
+	mpz_clear(engine->temp_mpz);
+	delete engine;
+	return NULL;
+}
+
+void crunch_engine_free(crunch_engine* engine) {
+	// Hand every worker an exit job. Each one claims a distinct slot, because exiting workers never free theirs.
+	for (int i = 0; i < engine->thread_count; i++) {
+		JobSlot& js = claim_job_slot(engine);
+		js.type = JOB_EXIT;
+		sem_post(&js.job_described);
+	}
+	for (int i = 0; i < engine->thread_count; i++)
+		pthread_join(engine->threads[i], NULL);
+
+	for (auto it = engine->computations.begin(); it != engine->computations.end(); it++)
+		for (auto comp = it->second.begin(); comp != it->second.end(); comp++)
+			delete comp->second;
+	for (auto it = engine->subscriptions.begin(); it != engine->subscriptions.end(); it++)
+		delete it->second;
+
+	for (int i = 0; i < engine->thread_count; i++) {
+		sem_destroy(&engine->job_slots[i].job_described);
+		mpz_clear(engine->job_slots[i].datum);
+	}
+	delete[] engine->job_slots;
+	delete[] engine->threads;
+	sem_destroy(&engine->workers_ready);
+	pthread_rwlock_destroy(&engine->globals_rwlock);
+	pthread_mutex_destroy(&engine->rounds_mutex);
+	pthread_mutex_destroy(&engine->rebuilds_mutex);
+	pthread_cond_destroy(&engine->rebuilds_cond);
+	mpz_clear(engine->temp_mpz);
+	delete engine;
+}
+
+// Deletes a subscription, along with its computations in any rounds still in flight. Must be called with the globals write locked.
+static void drop_subscription(crunch_engine* engine, SubId sub_id) {
+	pthread_mutex_lock(&engine->rounds_mutex);
+	for (auto it = engine->computations.begin(); it != engine->computations.end(); it++) {
+		auto comp = it->second.find(sub_id);
+		if (comp != it->second.end()) {
+			delete comp->second;
+			it->second.erase(comp);
+		}
+	}
+	pthread_mutex_unlock(&engine->rounds_mutex);
+	delete engine->subscriptions[sub_id];
+	engine->subscriptions.erase(sub_id);
+}
+
+// Loads a little-endian byte buffer into the calling thread's scratch number.
+static void import_bytes(crunch_engine* engine, const void* data, size_t length) {
+	mpz_import(engine->temp_mpz, length, -1, 1, 0, 0, data);
+}
+
+// The rest of each entry point, once its number has been parsed into temp_mpz.
+static int add_subscription(crunch_engine* engine, uint64_t sub_id, int exponent_bits) {
+	if (mpz_sgn(engine->temp_mpz) <= 0)
+		return CRUNCH_EINVAL;
+	// Assert some (extremely generous) range limits, and default to the modulus' own width.
+	if (exponent_bits < 0 || exponent_bits > 1048576)
+		return CRUNCH_EINVAL;
+	if (exponent_bits == 0)
+		exponent_bits = mpz_sizeinbase(engine->temp_mpz, 2);
+//	gmp_printf("Adding subscription: sub=%i mod=%Zd\n", sub_id, engine->temp_mpz);
+	WRITE_LOCK_GLOBALS(engine);
+	// Replace a previous subscription, if it exists.
+	if (engine->subscriptions.count(sub_id) == 1)
+		drop_subscription(engine, sub_id);
+	engine->subscriptions[sub_id] = new Subscription(engine, engine->temp_mpz, exponent_bits);
+	UNLOCK_GLOBALS(engine);
+	return CRUNCH_OK;
+}
+
+int crunch_add_subscription(crunch_engine* engine, uint64_t sub_id, int exponent_bits, const char* modulus) {
+	if (mpz_set_str(engine->temp_mpz, modulus, 16) != 0)
+		return CRUNCH_EINVAL;
+	return add_subscription(engine, sub_id, exponent_bits);
+}
+
+int crunch_add_subscription_bytes(crunch_engine* engine, uint64_t sub_id, int exponent_bits, const void* modulus, size_t length) {
+	import_bytes(engine, modulus, length);
+	return add_subscription(engine, sub_id, exponent_bits);
+}
+
+int crunch_set_default_table(crunch_engine* engine, int format, int tradeoff, int comb_blocks) {
+	TableSpec spec = {format, tradeoff, comb_blocks};
+	if (!valid_table_spec(spec))
+		return CRUNCH_EINVAL;
+	engine->default_table = spec;
+	return CRUNCH_OK;
+}
+
+static int add_entry(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, TableSpec wanted) {
+//	gmp_printf("Adding entry: sub=%i stream=%i base=%Zd\n", sub_id, stream_id, engine->temp_mpz);
+	WRITE_LOCK_GLOBALS(engine);
+	// Make sure the sub_id is real.
+	if (engine->subscriptions.count(sub_id) == 0) {
+		UNLOCK_GLOBALS(engine);
+		return CRUNCH_ENOSUB;
+	}
+	Subscription* sub = engine->subscriptions[sub_id];
+	// Tables too big to ever build (their sizes depend on the subscription's width) are skipped, and the
+	// entry falls back to plain exponentiations, as over-width datums do.
+	if (wanted.tradeoff != 0 && Table::get_table_length(wanted, sub->bits_per_field) > MAX_TABLE_LENGTH)
+		wanted.tradeoff = 0;
+	// Delete a previous entry, if it exists.
+	if (sub->entries.count(stream_id) == 1)
+		delete sub->entries[stream_id];
+	sub->entries[stream_id] = new Entry(sub, engine->temp_mpz, wanted);
+	UNLOCK_GLOBALS(engine);
+
+	// Issue a job to rebuild the table.
+	// This must happen outside the lock, as the worker takes the write lock to publish the table.
+	if (wanted.tradeoff != 0) {
+		// Counted before dispatch, so a wait issued right after this call already sees the job.
+		pthread_mutex_lock(&engine->rebuilds_mutex);
+		engine->pending_rebuilds++;
+		pthread_mutex_unlock(&engine->rebuilds_mutex);
+		JobSlot& js = claim_job_slot(engine);
+		js.type = JOB_REBUILD;
+		js.sub_id = sub_id;
+		js.stream_id = stream_id;
+		// Signal the thread to begin the job.
+		sem_post(&js.job_described);
+	}
+	return CRUNCH_OK;
+}
+
+int crunch_add_entry(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const char* base) {
+	if (mpz_set_str(engine->temp_mpz, base, 16) != 0)
+		return CRUNCH_EINVAL;
+	return add_entry(engine, sub_id, stream_id, engine->default_table);
+}
+
+int crunch_add_entry_bytes(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const void* base, size_t length) {
+	import_bytes(engine, base, length);
+	return add_entry(engine, sub_id, stream_id, engine->default_table);
+}
+
+int crunch_add_entry_table(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const char* base, int format, int tradeoff, int comb_blocks) {
+	TableSpec spec = {format, tradeoff, comb_blocks};
+	if (!valid_table_spec(spec) || mpz_set_str(engine->temp_mpz, base, 16) != 0)
+		return CRUNCH_EINVAL;
+	return add_entry(engine, sub_id, stream_id, spec);
+}
+
+int crunch_remove_subscription(crunch_engine* engine, uint64_t sub_id) {
+	WRITE_LOCK_GLOBALS(engine);
+	auto found = engine->subscriptions.find(sub_id);
+	if (found == engine->subscriptions.end()) {
+		UNLOCK_GLOBALS(engine);
+		return CRUNCH_ENOSUB;
+	}
+	drop_subscription(engine, sub_id);
+	UNLOCK_GLOBALS(engine);
+	return CRUNCH_OK;
+}
+
+static int submit(crunch_engine* engine, uint64_t stream_id, uint64_t round_number) {
+	if (mpz_sgn(engine->temp_mpz) < 0)
+		return CRUNCH_EINVAL;
+//	gmp_printf("Computation: stream=%i round=%i datum=%Zd\n", stream_id, round_number, engine->temp_mpz);
+
+	// Increment the number of jobs in the given round, and create any new computation objects required.
+	// Only the read lock is needed to walk the subscriptions, so this runs alongside the workers.
+	READ_LOCK_GLOBALS(engine);
+	pthread_mutex_lock(&engine->rounds_mutex);
+	if (engine->rounds.count(round_number) == 0)
+		engine->rounds[round_number] = RoundState{0, false, NULL, NULL};
+	engine->rounds[round_number].pending++;
+	map<SubId, Computation*>& comps = engine->computations[round_number];
+	for (auto it = engine->subscriptions.begin(); it != engine->subscriptions.end(); it++) {
+		// Create a computation object for this subscription in this round number.
+		if (comps.count(it->first) == 0)
+			comps[it->first] = new Computation(it->second, engine->thread_count);
+	}
+	pthread_mutex_unlock(&engine->rounds_mutex);
+	UNLOCK_GLOBALS(engine);
+
+	JobSlot& js = claim_job_slot(engine);
+	js.type = JOB_COMP;
+	js.stream_id = stream_id;
+	js.round_number = round_number;
+	mpz_set(js.datum, engine->temp_mpz);
+	// Signal the thread to begin the job.
+	sem_post(&js.job_described);
+	return CRUNCH_OK;
+}
+
+int crunch_submit(crunch_engine* engine, uint64_t stream_id, uint64_t round_number, const char* datum) {
+	if (mpz_set_str(engine->temp_mpz, datum, 16) != 0)
+		return CRUNCH_EINVAL;
+	return submit(engine, stream_id, round_number);
+}
+
+int crunch_submit_bytes(crunch_engine* engine, uint64_t stream_id, uint64_t round_number, const void* datum, size_t length) {
+	import_bytes(engine, datum, length);
+	return submit(engine, stream_id, round_number);
+}
+
+int crunch_submit_many(crunch_engine* engine, uint64_t round_number, size_t count, const uint64_t* stream_ids, const char* const* datums) {
+	for (size_t i = 0; i < count; i++) {
+		int status = crunch_submit(engine, stream_ids[i], round_number, datums[i]);
+		if (status != CRUNCH_OK)
+			return status;
+	}
+	return CRUNCH_OK;
+}
+
+int crunch_submit_many_bytes(crunch_engine* engine, uint64_t round_number, size_t count, const uint64_t* stream_ids, const void* const* datums, const size_t* lengths) {
+	for (size_t i = 0; i < count; i++) {
+		int status = crunch_submit_bytes(engine, stream_ids[i], round_number, datums[i], lengths[i]);
+		if (status != CRUNCH_OK)
+			return status;
+	}
+	return CRUNCH_OK;
+}
+
+int crunch_request_round(crunch_engine* engine, uint64_t round_number, crunch_round_callback callback, void* cookie) {
+//	gmp_printf("Replying: round=%lu\n", round_number);
+	// Flag the round as requested. Only rounds_mutex is needed, so this never waits on a running computation.
+	pthread_mutex_lock(&engine->rounds_mutex);
+	auto found = engine->rounds.find(round_number);
+	if (found == engine->rounds.end())
+		found = engine->rounds.insert(make_pair(round_number, RoundState{0, false, NULL, NULL})).first;
+	RoundState& state = found->second;
+	if (state.requested) {
+		pthread_mutex_unlock(&engine->rounds_mutex);
+		return CRUNCH_EBUSY;
+	}
+	state.requested = true;
+	state.callback = callback;
+	state.cookie = cookie;
+	bool round_done = state.pending == 0;
+	pthread_mutex_unlock(&engine->rounds_mutex);
+	// If work is still outstanding, the worker that finishes the last datum delivers the round.
+	// Otherwise the round is already done (or was never issued any computations), so deliver it right away.
+	if (round_done)
+		finish_round(engine, round_number);
+	return CRUNCH_OK;
+}
+
+struct CollectWaiter {
+	sem_t done;
+	crunch_round* result;
+};
+
+static void collect_callback(void* cookie, uint64_t round_number, crunch_round* result) {
+	CollectWaiter* waiter = (CollectWaiter*)cookie;
+	waiter->result = result;
+	sem_post(&waiter->done);
+}
+
+crunch_round* crunch_collect_round(crunch_engine* engine, uint64_t round_number) {
+	CollectWaiter waiter;
+	waiter.result = NULL;
+	if (sem_init(&waiter.done, 0, 0) != 0)
+		return NULL;
+	if (crunch_request_round(engine, round_number, collect_callback, &waiter) == CRUNCH_OK)
+		sem_wait(&waiter.done);
+	sem_destroy(&waiter.done);
+	return waiter.result;
+}
+
+int crunch_table_model(int format, int tradeoff, int comb_blocks, int exponent_bits, int modulus_bits, double* mults, double* bytes) {
+	TableSpec spec = {format, tradeoff, comb_blocks};
+	if (!valid_table_spec(spec) || exponent_bits < 1 || exponent_bits > 1048576 || modulus_bits < 1)
+		return CRUNCH_EINVAL;
+	model_table(spec, exponent_bits, modulus_bits, mults, bytes);
+	return CRUNCH_OK;
+}
+
+void crunch_wait_for_tables(crunch_engine* engine) {
+	pthread_mutex_lock(&engine->rebuilds_mutex);
+	while (engine->pending_rebuilds != 0)
+		pthread_cond_wait(&engine->rebuilds_cond, &engine->rebuilds_mutex);
+	pthread_mutex_unlock(&engine->rebuilds_mutex);
+}
+
+int crunch_pending_tables(crunch_engine* engine) {
+	pthread_mutex_lock(&engine->rebuilds_mutex);
+	int pending = engine->pending_rebuilds;
+	pthread_mutex_unlock(&engine->rebuilds_mutex);
+	return pending;
+}
+
+int crunch_stats(crunch_engine* engine, char* buf, size_t length) {
+	static const char* format_names[] = {"window", "signed", "comb"};
+	int written = 0;
+	READ_LOCK_GLOBALS(engine);
+	for (int format = 0; format < 3; format++) {
+		TableStats& stats = engine->table_stats[format];
+		double average = stats.tables == 0 ? 0.0 : stats.mults / stats.tables;
+		written += snprintf(buf + written, (size_t)written < length ? length - written : 0,
+			"%-6s tables: %i, %.2f MiB, ~%.1f mults/exp\n", format_names[format], stats.tables, stats.bytes / (1 << 20), average);
+	}
+	UNLOCK_GLOBALS(engine);
+	return written;
+}
+
+size_t crunch_round_size(const crunch_round* result) {
+	return result->sub_ids.size();
+}
+
+uint64_t crunch_round_sub_id(const crunch_round* result, size_t index) {
+	return result->sub_ids[index];
+}
+
+const char* crunch_round_value(const crunch_round* result, size_t index) {
+	if (result->values[index] == NULL)
+		result->values[index] = mpz_get_str(NULL, 16, result->numbers[index]);
+	return result->values[index];
+}
+
+size_t crunch_round_value_bytes(const crunch_round* result, size_t index, void* buf, size_t length) {
+	size_t needed = (mpz_sizeinbase(result->numbers[index], 2) + 7) / 8;
+	if (mpz_sgn(result->numbers[index]) == 0)
+		needed = 0;
+	if (needed <= length)
+		mpz_export(buf, NULL, -1, 1, 0, 0, result->numbers[index]);
+	return needed;
+}
+
+void crunch_round_free(crunch_round* result) {
+	delete result;
+}
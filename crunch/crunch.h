@@ -0,0 +1,117 @@
+// === libcrunch ===
+// Copyright 2014, Peter Schmidt-Nielsen.
+// Licensed under the MIT license.
+//
+// C API to the cruncher's subscription/entry/computation engine, for in-process use.
+// The cruncher binary is a thin network front-end over exactly these calls.
+//
+// Numbers cross the API either as null terminated hex strings, the same encoding the wire protocol uses,
+// or, through the _bytes variants, as little-endian unsigned byte buffers (Python's int.to_bytes(n, "little")),
+// which are copied straight into and out of GMP without any formatting.
+// Unless otherwise noted, calls on a single engine must be serialized by the caller; the engine
+// does its own locking against its worker threads.
+
+#ifndef CRUNCH_H
+#define CRUNCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Return codes. Every int-returning call gives CRUNCH_OK on success.
+#define CRUNCH_OK 0
+// A hex string failed to parse, or an argument was out of range.
+#define CRUNCH_EINVAL -1
+// The given subscription ID does not exist.
+#define CRUNCH_ENOSUB -2
+// The round has already been requested, and has not finished yet.
+#define CRUNCH_EBUSY -3
+
+// Acceleration table formats, selectable per entry. crunch_table_model estimates the speed and size of each.
+// Fixed-base windows: (2^tradeoff - 1) stored powers per tradeoff-bit chunk of the exponent.
+#define CRUNCH_TABLE_WINDOW 0
+// Signed-digit windows: digits in (-2^(tradeoff-1), 2^(tradeoff-1)], so 2^(tradeoff-1) powers per chunk,
+// about half the window table. Negative digits are divided out with one inversion per round and subscription.
+#define CRUNCH_TABLE_SIGNED 1
+// Lim-Lee comb: tradeoff teeth, comb_blocks blocks, comb_blocks * (2^tradeoff - 1) stored powers in total,
+// paying about ceil(bits / (tradeoff * comb_blocks)) squarings per exponentiation.
+#define CRUNCH_TABLE_COMB 2
+
+typedef struct crunch_engine crunch_engine;
+typedef struct crunch_round crunch_round;
+
+// Creates an engine backed by thread_count worker threads, building default_tradeoff-bit window tables.
+// Returns NULL if the parameters are out of range, or the threads or their locks could not be created.
+crunch_engine* crunch_engine_new(int thread_count, int default_tradeoff);
+// Changes the table built for entries added by crunch_add_entry. A tradeoff of zero builds no tables.
+int crunch_set_default_table(crunch_engine* engine, int format, int tradeoff, int comb_blocks);
+// Stops the worker threads and frees all subscriptions and outstanding rounds.
+void crunch_engine_free(crunch_engine* engine);
+
+// Adds (or replaces) a subscription with the given modulus, whose datums are at most exponent_bits wide.
+// Its entries' tables are sized to exponent_bits; zero means the width of the modulus. Wider datums still
+// give correct results, but skip the tables.
+int crunch_add_subscription(crunch_engine* engine, uint64_t sub_id, int exponent_bits, const char* modulus);
+int crunch_add_subscription_bytes(crunch_engine* engine, uint64_t sub_id, int exponent_bits, const void* modulus, size_t length);
+// Adds (or replaces) the entry for the given stream in a subscription. The acceleration table is built asynchronously.
+// An entry whose table would exceed 2^26 powers at the subscription's exponent width gets no table, and so
+// computes with plain modular exponentiations.
+int crunch_add_entry(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const char* base);
+int crunch_add_entry_bytes(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const void* base, size_t length);
+// As crunch_add_entry, but builds the given table format for this entry instead of the default.
+int crunch_add_entry_table(crunch_engine* engine, uint64_t sub_id, uint64_t stream_id, const char* base, int format, int tradeoff, int comb_blocks);
+// Removes a subscription and all of its entries.
+int crunch_remove_subscription(crunch_engine* engine, uint64_t sub_id);
+
+// In the given round, the given stream reads the given datum.
+int crunch_submit(crunch_engine* engine, uint64_t stream_id, uint64_t round, const char* datum);
+int crunch_submit_bytes(crunch_engine* engine, uint64_t stream_id, uint64_t round, const void* datum, size_t length);
+// Submits count datums to one round at once. Stops at, and returns the error of, the first bad datum.
+int crunch_submit_many(crunch_engine* engine, uint64_t round, size_t count, const uint64_t* stream_ids, const char* const* datums);
+int crunch_submit_many_bytes(crunch_engine* engine, uint64_t round, size_t count, const uint64_t* stream_ids, const void* const* datums, const size_t* lengths);
+
+// Called once a requested round has finished, from whichever thread finished it (usually a worker thread,
+// or the requesting thread if the round was already done). The callee owns result, and must free it
+// with crunch_round_free. It must not call back into the engine, and should return promptly.
+typedef void (*crunch_round_callback)(void* cookie, uint64_t round, crunch_round* result);
+
+// Asks for the results of a round without blocking. The round is closed as soon as every datum submitted
+// to it so far has been processed; its storage is released inside the engine and callback is invoked.
+// Requesting a round that was never submitted to completes immediately with an empty result.
+int crunch_request_round(crunch_engine* engine, uint64_t round, crunch_round_callback callback, void* cookie);
+
+// Blocking form of crunch_request_round: waits for the round and returns its per-subscription results.
+// The returned object must be freed with crunch_round_free. Returns NULL if the round was already requested
+// (or if no semaphore could be created to wait on).
+crunch_round* crunch_collect_round(crunch_engine* engine, uint64_t round);
+size_t crunch_round_size(const crunch_round* result);
+uint64_t crunch_round_sub_id(const crunch_round* result, size_t index);
+// The hex string is rendered on first use, and owned by result.
+const char* crunch_round_value(const crunch_round* result, size_t index);
+// Writes the result little-endian into buf if it fits in length bytes. Returns the number of bytes it needs
+// (zero for a zero result), so a first call with length zero sizes the buffer.
+size_t crunch_round_value_bytes(const crunch_round* result, size_t index, void* buf, size_t length);
+void crunch_round_free(crunch_round* result);
+
+// Blocks until every table build issued so far has finished (or been abandoned, as its entry was replaced).
+// Datums submitted before then may be computed without their entry's table. Safe to call from any thread.
+void crunch_wait_for_tables(crunch_engine* engine);
+// The number of table builds issued that have not finished yet. Safe to call from any thread.
+int crunch_pending_tables(crunch_engine* engine);
+
+// Estimates one exponentiation by an exponent_bits-bit exponent, in modular multiplications (squarings included),
+// and the size in bytes of the table that makes it, for a modulus_bits-bit modulus.
+// Returns CRUNCH_EINVAL, leaving mults and bytes untouched, for an invalid table spec or width.
+int crunch_table_model(int format, int tradeoff, int comb_blocks, int exponent_bits, int modulus_bits, double* mults, double* bytes);
+// Writes a summary of the installed tables to buf, one line per format: count, memory, and modelled mults/exp.
+// Returns the length of the full summary, as snprintf does.
+int crunch_stats(crunch_engine* engine, char* buf, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
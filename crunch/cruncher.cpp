@@ -6,15 +6,25 @@
 // The entire purpose is to evaluate the homomorphic matrix multiplication on a (potentially) sparse submatrix.
 // The allowed commands from the server to this program are documented:
 // In each case, "abc": string literal, I: 8 byte integer, Z: null terminated string hex number.
-//   "s" I:subid Z:m -- Add a subscription with the given subscription ID, and the given modulus m.
+//   "s" I:subid I:bits Z:m -- Add a subscription with the given subscription ID, and the given modulus m.
+//     Datums for it are at most the given number of bits wide, or as wide as m if bits is zero.
 //   "a" I:subid I:streamid Z:base -- Add an entry to the given subscription corresponding to the given stream ID, with the given base.
 //   "d" I:subid -- Remove a given subscription.
 //   "c" I:streamid I:round Z:datum -- In the given round, the given stream reads the given datum.
 // The following commands return data back to the server:
 //   "r" I:round -- Returns: I:numoffields <fields>, with each field being I:subid Z:result.
 //   "i" -- Returns some basic information.
+// Replies are always sent in the order their commands arrived. Neither command blocks the command loop:
+// an "r" is answered once its round finishes, while later commands (including work for later rounds) keep flowing.
 //
-// The computation is performed by a pool of worker threads.
+// The computation itself is performed by libcrunch (see crunch.h); this program is only a network front-end.
+//
+// For offline benchmarking, the incoming command stream can be captured to a trace file (-w), and a trace
+// can later be replayed in place of a server (-R), at its original pacing or as fast as possible (-F).
+// Tables are built in the background, so a fast replay would otherwise compute on entries whose tables are not
+// built yet; -W (implied by -F) holds back the first "c" after any "a" until every table build has finished.
+// Trace files begin with the 8 bytes "CRTRACE1", followed by one record per chunk read from the server:
+//   I:microseconds since the connection was made, 4 byte length, then that many bytes of the command stream.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,219 +34,148 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
-#include <semaphore.h>
-#include <gmp.h>
+#include <signal.h>
 
 using namespace std;
-#include <iostream>
 #include <vector>
-#include <map>
+#include <deque>
+#include <algorithm>
+
+#include "crunch.h"
 
 // Specifies the maximum number of bytes in a variable length field in a command recieved over the network.
 #define READ_BUFFER_LENGTH 65536
+// The most bytes of the command stream read (or captured, or replayed) at once.
+#define INPUT_CHUNK_LENGTH 65536
+#define TRACE_MAGIC "CRTRACE1"
 
 typedef uint64_t RoundNum;
 typedef uint64_t SubId;
 typedef uint64_t StreamId;
 
-struct Subscription;
-struct Entry;
-struct Computation;
-
-typedef enum {
-	JOB_NONE,
-	JOB_COMP,
-	JOB_REBUILD,
-} jobtype_t;
-
-struct JobSlot {
-	StreamId stream_id;
-	RoundNum round_number;
-	mpz_t datum;
-	Entry* to_rebuild;
-	jobtype_t type;
-	sem_t job_described;
-	bool ready_for_job;
+// A reply to the server, which becomes ready once its data has been serialized.
+struct Reply {
+	char* data;
+	size_t length;
+	bool ready;
+	// When the "r" asking for this reply arrived, or zero for other replies.
+	uint64_t requested_us;
 };
 
-// Global storage.
-namespace global {
-	int thread_count;
-	int bits_per_field;
-	int default_tradeoff;
-	// Maps subscription number to a subscription.
-	map<SubId, Subscription*> subscriptions;
-	// Maps a round and subid to a computation object.
-	map<RoundNum, map<SubId, Computation*>> computations;
-	// Maps a round to a semaphore that will accumulate a post per completed computation.
-	map<RoundNum, sem_t> round_semaphore;
-	// Maps a round to the number of computations (i.e. number of times to call wait) in a round.
-	map<RoundNum, int> round_semaphore_waits;
-	// Data used for communication between the workers and the main thread.
-	JobSlot* job_slots;
-	// This lock synchronizes reads and writes to subscriptions and computations.
-	pthread_rwlock_t globals_rwlock;
-	// These semaphores are used to send jobs to worker threads, and signal the main thread that the job data has been read respectively.
-	sem_t workers_ready; 
-}
-#define READ_LOCK_GLOBALS pthread_rwlock_rdlock(&global::globals_rwlock)
-#define WRITE_LOCK_GLOBALS pthread_rwlock_wrlock(&global::globals_rwlock)
-#define UNLOCK_GLOBALS pthread_rwlock_unlock(&global::globals_rwlock)
-
-struct Subscription {
-	mpz_t modulus;
-	// Maps stream number to an entry.
-	map<StreamId, Entry*> entries;
-
-	Subscription(mpz_t _modulus) {
-		mpz_init_set(modulus, _modulus);
-	}
-
-	~Subscription() {
-		mpz_clear(modulus);
-		for (auto it = entries.begin(); it != entries.end(); it++) {
-			delete it->second;
-		}
-	}
+// The incoming command stream. When capturing, every chunk read is also appended to the trace file;
+// when replaying, chunks come from a trace file instead of the server.
+struct Input {
+	int fd;
+	char data[INPUT_CHUNK_LENGTH];
+	size_t pos, len;
+	FILE* capture;
+	FILE* replay;
+	// Whether replayed chunks are held back until their recorded time.
+	bool paced;
+	uint64_t start_us;
 };
 
-struct Entry {
-	mpz_t base;
-	int tradeoff;
-	int table_length;
-	mpz_t* precomputed_table;
-	Subscription* parent;
-
-	Entry(Subscription* parent, mpz_t _base) : tradeoff(0), table_length(0), precomputed_table(NULL), parent(parent) {
-		mpz_init_set(base, _base);
-	}
-
-	~Entry() {
-		mpz_clear(base);
-		free_table();
-	}
-
-	void free_table() {
-		if (precomputed_table == NULL)
-			return;
-		for (int i = 0; i < table_length; i++)
-			mpz_clear(precomputed_table[i]);
-		tradeoff = 0;
-		table_length = 0;
-		precomputed_table = NULL;
-		delete* precomputed_table;
-	}
-
-	inline int get_required_chunks() {
-		// The number of required chunks is ceil(bits_per_field / tradeoff)
-		return (global::bits_per_field + tradeoff - 1) / tradeoff;
-	}
-
-	inline int get_nums_per_chunk() {
-		// Each chunk has one number per non-zero bit pattern of up to tradeoff bits.
-		return (1 << tradeoff) - 1;
-	}
+// State shared between the command loop, the completion callbacks, and the writer thread.
+namespace global {
+	int sockfd;
+	// Replies in the order their commands arrived. Only the writer thread pops from the front.
+	deque<Reply*> replies;
+	// Set by the command loop when the server hangs up, so the writer exits once the queue drains.
+	bool closing;
+	pthread_mutex_t replies_mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t replies_cond = PTHREAD_COND_INITIALIZER;
+	// Set by the writer if sending fails. From then on replies are dropped as they become ready.
+	bool write_failed;
+	uint64_t dropped_replies;
+	// Time from each "r" arriving to its round's results being ready, and when the last reply became ready.
+	vector<uint64_t> round_latencies_us;
+	uint64_t last_ready_us;
+}
 
-	void rebuild_table(int new_tradeoff) {
-		free_table();
-		tradeoff = new_tradeoff;
-		// A tradeoff value of zero disables the precomputed table mode.
-		if (tradeoff == 0)
-			return;
-		int required_chunks = get_required_chunks();
-		int nums_per_chunk = get_nums_per_chunk();
-		precomputed_table = new mpz_t[required_chunks * nums_per_chunk];
-		mpz_t x, y;
-		mpz_init_set(x, base);
-		mpz_init(y);
-		for (int chunk = 0; chunk < required_chunks; chunk++) {
-			mpz_set_ui(y, 1);
-			for (int i = 0; i < nums_per_chunk; i++) {
-				mpz_mul(y, x, y);
-				mpz_mod(y, y, parent->modulus);
-				mpz_init_set(precomputed_table[chunk*nums_per_chunk + i], y);
-			}
-			// Advance x by tradeoff bits.
-			mpz_powm_ui(x, x, 1 << tradeoff, parent->modulus);
-		}
-		mpz_clear(x);
-		mpz_clear(y);
-	}
+uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
 
-	void exponentiate(mpz_t dest, mpz_t datum) {
-//		gmp_printf("Exponentiating: %Zd ** %Zd mod %Zd\n", base, datum, parent->modulus);
-		// If no table is built, run a vanilla modular exponentiation.
-		if (tradeoff == 0) {
-			mpz_powm(dest, base, datum, parent->modulus);
-			return;
+// Reads the next chunk of the command stream. Returns false at the end of the stream.
+bool input_refill(Input* in) {
+	in->pos = 0;
+	in->len = 0;
+	if (in->replay != NULL) {
+		uint64_t timestamp;
+		uint32_t length;
+		if (fread(&timestamp, sizeof timestamp, 1, in->replay) != 1 || fread(&length, sizeof length, 1, in->replay) != 1)
+			return false;
+		if (length > INPUT_CHUNK_LENGTH) {
+			fprintf(stderr, "Corrupt trace record of %u bytes.\n", length);
+			exit(1);
 		}
-		// Otherwise, let's use our table.
-		// A copy of datum, to avoid mutating our input.
-		mpz_t _datum;
-		mpz_init_set(_datum, datum);
-		int required_chunks = get_required_chunks();
-		int nums_per_chunk = get_nums_per_chunk();
-		int table_index = 0;
-		mp_limb_t bit_mask = (1 << tradeoff) - 1;
-		mpz_set_ui(dest, 1);
-		for (int chunk = 0; chunk < required_chunks; chunk++) {
-			// Get the bit pattern for this chunk.
-			mp_limb_t bits = mpz_getlimbn(_datum, 0) & bit_mask;
-			// Right shift the bits.
-			mpz_tdiv_q_2exp(_datum, _datum, tradeoff);
-			if (bits != 0) {
-				// Multiply in the appropriate table entry.
-				// The subtraction of 1 is because we don't need a table entry for the zero bit pattern.
-				mpz_mul(dest, dest, precomputed_table[table_index + bits - 1]);
-				mpz_mod(dest, dest, parent->modulus);
-			}
-			table_index += nums_per_chunk;
+		if (fread(in->data, 1, length, in->replay) != length)
+			return false;
+		if (in->paced) {
+			uint64_t elapsed = now_us() - in->start_us;
+			if (timestamp > elapsed)
+				usleep(timestamp - elapsed);
 		}
+		in->len = length;
+		return true;
 	}
-
-};
-
-struct Computation {
-	Subscription* sub;
-	mpz_t* accums;
-	int pending_computations;
-
-	Computation(Subscription* sub) : sub(sub), pending_computations(0) {
-		// Allocate one accumulator per thread, so that multiple threads can work on the computation at the same time.
-		// In the end, the answer is the product of these accumulators.
-		accums = new mpz_t[global::thread_count];
-		for (int i = 0; i < global::thread_count; i++)
-			mpz_init_set_ui(accums[i], 1);
-	}
-
-	~Computation() {
-		for (int i = 0; i < global::thread_count; i++)
-			mpz_clear(accums[i]);
-		delete* accums;
+	ssize_t bytes;
+	do {
+		bytes = read(in->fd, in->data, INPUT_CHUNK_LENGTH);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes <= 0)
+		return false;
+	in->len = bytes;
+	if (in->capture != NULL) {
+		uint64_t timestamp = now_us() - in->start_us;
+		uint32_t length = bytes;
+		fwrite(&timestamp, sizeof timestamp, 1, in->capture);
+		fwrite(&length, sizeof length, 1, in->capture);
+		fwrite(in->data, 1, length, in->capture);
+		// Flush per chunk, so that a trace survives the cruncher crashing, which is when it is most wanted.
+		fflush(in->capture);
 	}
+	return true;
+}
 
-	void process_datum(int thread_index, StreamId stream, mpz_t datum) {
-		Entry* entry = sub->entries[stream];
-		mpz_t local;
-		mpz_init(local);
-		entry->exponentiate(local, datum);
-//		gmp_printf("Computed additional: %Zd\n", local);
-		mpz_mul(accums[thread_index], accums[thread_index], local);
-		mpz_mod(accums[thread_index], accums[thread_index], sub->modulus);
-		mpz_clear(local);
+bool input_read(Input* in, void* dest, size_t length) {
+	char* out = (char*)dest;
+	while (length > 0) {
+		while (in->pos == in->len)
+			if (!input_refill(in))
+				return false;
+		size_t bytes = min(length, in->len - in->pos);
+		memcpy(out, in->data + in->pos, bytes);
+		in->pos += bytes;
+		out += bytes;
+		length -= bytes;
 	}
+	return true;
+}
 
-	void produce_result(mpz_t output) {
-		mpz_set_ui(output, 1);
-		// Multiply all the thread-specific accumulators together.
-		for (int i = 0; i < global::thread_count; i++) {
-			mpz_mul(output, output, accums[i]);
-			mpz_mod(output, output, sub->modulus);
-		}
+// Reads a null terminated field into buf, keeping at most READ_BUFFER_LENGTH bytes of it.
+bool input_read_field(Input* in, char* buf) {
+	size_t i = 0;
+	while (1) {
+		while (in->pos == in->len)
+			if (!input_refill(in))
+				return false;
+		char c = in->data[in->pos++];
+		if (i < READ_BUFFER_LENGTH)
+			buf[i++] = c;
+		if (c == 0)
+			return true;
 	}
-};
+}
 
 int create_connection(const char* hostname, const char* service) {
 	int fd;
@@ -252,304 +191,341 @@ int create_connection(const char* hostname, const char* service) {
 	return fd;
 }
 
-void* process_thread(void* cookie) {
-	int thread_index = *(int*)cookie;
-	delete (int*)cookie;
-	mpz_t datum;
-	mpz_init(datum);
+Reply* queue_reply(uint64_t requested_us) {
+	Reply* reply = new Reply{NULL, 0, false, requested_us};
+	pthread_mutex_lock(&global::replies_mutex);
+	global::replies.push_back(reply);
+	pthread_mutex_unlock(&global::replies_mutex);
+	return reply;
+}
 
-	while (1) {
-		// Grab a job in our slot.
-		sem_wait(&global::job_slots[thread_index].job_described);
-		// Read in the job.
-		JobSlot& js = global::job_slots[thread_index];
-		Entry* entry = js.to_rebuild;
-		StreamId stream_id = js.stream_id;
-		RoundNum round_number = js.round_number;
-		jobtype_t type = js.type;
-		if (type == JOB_COMP)
-			mpz_set(datum, js.datum);
-//		gmp_printf("Starting job: stream=%i round=%i datum=%Zd\n", stream_id, round_number, datum);
-		// Tell the main thread that we're done reading in the job description.
-		// Find each subscription object, and build the computation required.
-//		gmp_printf("Performing job: stream=%i round=%i datum=%Zd\n", stream_id, round_number, datum);
-		js.ready_for_job = true;
-		sem_post(&global::workers_ready);
-
-		if (type == JOB_COMP) {
-			READ_LOCK_GLOBALS;
-			gmp_printf("Computing in thread: %i\n", thread_index);
-			for (auto it = global::subscriptions.begin(); it != global::subscriptions.end(); it++) {
-				SubId sub_id = it->first;
-				Computation* comp = global::computations[round_number][sub_id];
-				comp->process_datum(thread_index, stream_id, datum);
-			}
-			sem_post(&global::round_semaphore[round_number]);
-			UNLOCK_GLOBALS;
-		} else if (type == JOB_REBUILD) {
-			gmp_printf("Rebuilding %p as %i-bit in thread: %i\n", entry, global::default_tradeoff, thread_index);
-			entry->rebuild_table(global::default_tradeoff);
+void mark_reply_ready(Reply* reply, char* data, size_t length) {
+	pthread_mutex_lock(&global::replies_mutex);
+	reply->data = data;
+	reply->length = length;
+	reply->ready = true;
+	global::last_ready_us = now_us();
+	if (reply->requested_us != 0)
+		global::round_latencies_us.push_back(global::last_ready_us - reply->requested_us);
+	pthread_cond_broadcast(&global::replies_cond);
+	pthread_mutex_unlock(&global::replies_mutex);
+}
+
+// The completion path for "r": runs on whichever engine thread finishes the round, and serializes
+// the whole reply into one buffer, so the writer can send it without touching the engine.
+void round_finished(void* cookie, uint64_t round_number, crunch_round* result) {
+	size_t count = crunch_round_size(result);
+	size_t length = 8;
+	for (size_t i = 0; i < count; i++)
+		length += 8 + strlen(crunch_round_value(result, i)) + 1;
+	char* data = (char*)malloc(length);
+	char* out = data;
+	uint64_t field = count;
+	memcpy(out, &field, 8);
+	out += 8;
+	for (size_t i = 0; i < count; i++) {
+		field = crunch_round_sub_id(result, i);
+		memcpy(out, &field, 8);
+		out += 8;
+		const char* value = crunch_round_value(result, i);
+		size_t bytes = strlen(value) + 1;
+		memcpy(out, value, bytes);
+		out += bytes;
+	}
+	crunch_round_free(result);
+	mark_reply_ready((Reply*)cookie, data, length);
+}
+
+// Writes out every iovec completely, retrying after short writes. Returns false if the connection failed.
+bool writev_all(int fd, struct iovec* iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writev");
+			return false;
+		}
+		// Skip past the iovecs that were fully written, and trim the one that was partially written.
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
 		}
 	}
+	return true;
+}
+
+// Sends replies in order. Every ready reply at the front of the queue goes out in a single writev.
+// If the connection fails, the rest are dropped instead, and the command loop is woken to hang up normally,
+// so the exit report (and any capture) still completes.
+void* writer_thread(void* cookie) {
+	vector<Reply*> batch;
+	vector<struct iovec> iov;
+	pthread_mutex_lock(&global::replies_mutex);
+	while (1) {
+		while (!(global::replies.size() > 0 && global::replies.front()->ready) && !(global::closing && global::replies.empty()))
+			pthread_cond_wait(&global::replies_cond, &global::replies_mutex);
+		if (global::replies.empty())
+			break;
+		while (global::replies.size() > 0 && global::replies.front()->ready && batch.size() < IOV_MAX) {
+			Reply* reply = global::replies.front();
+			global::replies.pop_front();
+			batch.push_back(reply);
+			iov.push_back({reply->data, reply->length});
+		}
+		pthread_mutex_unlock(&global::replies_mutex);
+
+		if (global::write_failed) {
+			global::dropped_replies += batch.size();
+		} else if (!writev_all(global::sockfd, &iov[0], iov.size())) {
+			global::write_failed = true;
+			global::dropped_replies += batch.size();
+			// Replies still being computed must be left for their callbacks, so the queue can't simply be emptied.
+			// Shutting down the read side ends the command stream instead, and the queue drains from there.
+			shutdown(global::sockfd, SHUT_RD);
+		}
+		for (size_t i = 0; i < batch.size(); i++) {
+			free(batch[i]->data);
+			delete batch[i];
+		}
+		batch.clear();
+		iov.clear();
 
-	mpz_clear(datum);
+		pthread_mutex_lock(&global::replies_mutex);
+	}
+	pthread_mutex_unlock(&global::replies_mutex);
 	return NULL;
 }
 
 void print_usage_and_quit() {
 	printf("Usage: cruncher [options] host port\n");
+	printf("       cruncher [options] -R trace\n");
 	printf("  -t n -- Use n worker threads, plus the main thread.\n");
 	printf("  -z n -- Use n-bit acceleration tables.\n");
+	printf("  -f format -- Table format: window (default), signed, or comb.\n");
+	printf("  -b n -- Split comb tables into n blocks (default 1).\n");
+	printf("  -w file -- Capture the command stream from the server to a trace file.\n");
+	printf("  -R file -- Replay a trace file (or - for stdin) instead of connecting.\n");
+	printf("  -F -- Replay as fast as possible, rather than at the original pacing.\n");
+	printf("        Implies -W.\n");
+	printf("  -W -- Wait for table builds before computing on newly added entries.\n");
 	printf("\n");
 	printf("Scaling: n-bit tables provide n times speedup, but takes (2^n)/n space.\n");
 	printf("Setting n = 0 turns off acceleration tables, which reduces space\n");
 	printf("consumption by a factor of about 2000, and only slows things down by a\n");
 	printf("factor of about 2, as compared to n = 1.\n");
+	printf("Signed tables run at the speed of window tables of the same n, in half\n");
+	printf("the space. Comb tables store only b*(2^n - 1) numbers, and add about\n");
+	printf("bits/(n*b) squarings, where bits is the subscription's exponent width;\n");
+	printf("e.g. at 2048 bits -f comb -z 12 -b 16 is within 6%% of the speed of\n");
+	printf("-z 12 windows, in the space of -z 8 windows.\n");
 	exit(2);
 }
 
 int main(int argc, char** argv) {
 	// Set some reasonable defaults.
-	global::thread_count = 8;
-	global::default_tradeoff = 0;
-	global::bits_per_field = 2048;
+	int thread_count = 8;
+	int default_tradeoff = 0;
+	int table_format = CRUNCH_TABLE_WINDOW;
+	int comb_blocks = 1;
+	static const char* format_names[] = {"window", "signed", "comb"};
+	const char* capture_path = NULL;
+	const char* replay_path = NULL;
+	bool paced = true;
+	bool wait_for_tables = false;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "t:z:")) != -1) {
+	while ((opt = getopt(argc, argv, "t:z:f:b:w:R:FW")) != -1) {
 		switch (opt) {
 			case 't':
-				global::thread_count = atoi(optarg);
+				thread_count = atoi(optarg);
 				break;
 			case 'z':
-				global::default_tradeoff = atoi(optarg);
+				default_tradeoff = atoi(optarg);
+				break;
+			case 'f':
+				for (table_format = 0; table_format < 3; table_format++)
+					if (strcmp(optarg, format_names[table_format]) == 0)
+						break;
+				if (table_format == 3)
+					print_usage_and_quit();
+				break;
+			case 'b':
+				comb_blocks = atoi(optarg);
+				break;
+			case 'w':
+				capture_path = optarg;
+				break;
+			case 'R':
+				replay_path = optarg;
+				break;
+			case 'F':
+				paced = false;
+				wait_for_tables = true;
+				break;
+			case 'W':
+				wait_for_tables = true;
 				break;
 			default:
 				print_usage_and_quit();
 		}
 	}
-	// Assert some (extremely generous) range limits.
-	assert(global::thread_count >= 1 && global::thread_count <= 1024);
-	assert(global::default_tradeoff >= 0 && global::default_tradeoff <= 16);
-	assert(global::bits_per_field >= 0 && global::bits_per_field <= 1048576);
 
-	// Expect exactly two additional arguments.
-	if (optind != argc - 2) {
+	// Expect exactly two additional arguments, unless replaying, which expects none.
+	if (optind != argc - (replay_path == NULL ? 2 : 0) || (replay_path != NULL && capture_path != NULL)) {
+		print_usage_and_quit();
+	}
+
+	// The engine rejects values outside some (extremely generous) range limits.
+	crunch_engine* engine = crunch_engine_new(thread_count, 0);
+	if (engine == NULL || crunch_set_default_table(engine, table_format, default_tradeoff, comb_blocks) != CRUNCH_OK) {
+		fprintf(stderr, "Invalid thread count, tradeoff, or comb blocks.\n");
 		print_usage_and_quit();
 	}
 
-	// Print some information confirming the options.
-	printf("Using: %i threads, ", global::thread_count);
-	if (global::default_tradeoff == 0)
+	// Print some information confirming the options, and what the chosen tables should cost.
+	printf("Using: %i threads, ", thread_count);
+	if (default_tradeoff == 0)
 		printf("no acceleration tables\n");
+	else if (table_format == CRUNCH_TABLE_COMB)
+		printf("%i-bit comb acceleration tables in %i blocks\n", default_tradeoff, comb_blocks);
 	else
-		printf("%i-bit acceleration tables\n", global::default_tradeoff);
-	printf("=== %s:%s\n", argv[argc-2], argv[argc-1]);
-
-	int sockfd = create_connection(argv[argc-2], argv[argc-1]);
-	printf("Connected.\n");
-
-	assert(sem_init(&global::workers_ready, 0, global::thread_count) == 0);
-	assert(pthread_rwlock_init(&global::globals_rwlock, NULL) == 0);
-
-	// Construct the job slot structure.
-	// This consists of one semaphore and one flag per job slot.
-	// Each thread waits on its job slot's semaphore.
-	// When triggered, it reads in the job in.
-	// TODO: finish documenting protocol
-	global::job_slots = new JobSlot[global::thread_count];
-	for (int i = 0; i < global::thread_count; i++) {
-		assert(sem_init(&global::job_slots[i].job_described, 0, 0) == 0);
-		global::job_slots[i].ready_for_job = true;
-		mpz_init(global::job_slots[i].datum);
+		printf("%i-bit %s acceleration tables\n", default_tradeoff, format_names[table_format]);
+	double mults, bytes;
+	crunch_table_model(table_format, default_tradeoff, comb_blocks, 2048, 2048, &mults, &bytes);
+	// Table sizes follow each subscription's width, so this is only an example; the exit report models the real tables.
+	printf("Model for an example 2048-bit subscription: ~%.1f mults/exp, %.2f MiB/entry\n", mults, bytes / (1 << 20));
+
+	Input* input = new Input;
+	input->pos = input->len = 0;
+	input->capture = input->replay = NULL;
+	input->paced = paced;
+	int sockfd;
+	if (replay_path != NULL) {
+		// Replies to a replayed trace have nowhere to go.
+		printf("=== Replaying %s %s\n", replay_path, paced ? "at the original pacing" : "as fast as possible");
+		input->replay = strcmp(replay_path, "-") == 0 ? stdin : fopen(replay_path, "rb");
+		char magic[8];
+		if (input->replay == NULL || fread(magic, 1, 8, input->replay) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+			fprintf(stderr, "%s: not a trace file\n", replay_path);
+			exit(1);
+		}
+		sockfd = open("/dev/null", O_WRONLY);
+	} else {
+		printf("=== %s:%s\n", argv[argc-2], argv[argc-1]);
+		sockfd = create_connection(argv[argc-2], argv[argc-1]);
+		printf("Connected.\n");
+		if (capture_path != NULL) {
+			input->capture = fopen(capture_path, "wb");
+			if (input->capture == NULL) {
+				perror(capture_path);
+				exit(1);
+			}
+			fwrite(TRACE_MAGIC, 1, 8, input->capture);
+			printf("Capturing to %s\n", capture_path);
+		}
 	}
+	input->fd = global::sockfd = sockfd;
+	input->start_us = now_us();
 
-	// Spawn worker threads.
-	vector<pthread_t> threads;
-	threads.resize(global::thread_count);
-	for (int i = 0; i < global::thread_count; i++)
-		pthread_create(&threads[i], NULL, process_thread, (void*)new int(i));
+	// Spawn the thread that sends replies back to the server.
+	// A server that hangs up mid-reply should end the session through the hangup path, not SIGPIPE.
+	signal(SIGPIPE, SIG_IGN);
+	global::closing = false;
+	pthread_t writer;
+	pthread_create(&writer, NULL, writer_thread, NULL);
 
 	char* buf = new char[READ_BUFFER_LENGTH+1];
 	// Make sure the whole buffer is null terminated.
 	buf[READ_BUFFER_LENGTH] = 0;
-	int buf_i = 0;
 
+	// A command cut off by the end of the stream is dropped.
 	#define READ_FIELD \
 		do { \
-			buf_i = 0; \
-			while (buf_i < READ_BUFFER_LENGTH) { \
-				buf[buf_i] = 0; \
-				read(sockfd, buf+buf_i, 1); \
-				if (buf[buf_i++] == 0) \
-					break; \
-			} \
+			if (!input_read_field(input, buf)) \
+				goto hangup; \
+		} while (0)
+
+	#define CHECK(call) \
+		do { \
+			int status = (call); \
+			if (status != CRUNCH_OK) \
+				fprintf(stderr, "Command '%c' failed with status %i.\n", type, status); \
 		} while (0)
 
-	mpz_t temp_mpz;
-	mpz_init(temp_mpz);
+	// Counts of each command received, indexed by command character.
+	uint64_t command_counts[256] = {0};
+	// Whether an entry may have been added since the last wait for table builds.
+	bool tables_building = false;
 
 	// Wait for commands from the server in an infinite loop.
 	while (1) {
 		char type = -1;
-		if (read(sockfd, &type, 1) != 1)
+		if (!input_read(input, &type, 1))
 			break;
+		command_counts[(unsigned char)type]++;
 		SubId sub_id = 0;
 		StreamId stream_id = 0;
 		RoundNum round_number = 0;
-		#define FILL(x) read(sockfd, &x, sizeof x)
+		uint64_t exponent_bits = 0;
+		Reply* reply;
+		int status;
+		#define FILL(x) \
+			do { \
+				if (!input_read(input, &x, sizeof x)) \
+					goto hangup; \
+			} while (0)
 		switch (type) {
 			case 's':
 				// Add a subscription.
 				FILL(sub_id);
+				FILL(exponent_bits);
 				READ_FIELD; // Read in the modulus.
-				mpz_set_str(temp_mpz, buf, 16);
-//				gmp_printf("Adding subscription: sub=%i mod=%Zd\n", sub_id, temp_mpz);
-				// Create the subscription.
-				WRITE_LOCK_GLOBALS;
-				global::subscriptions[sub_id] = new Subscription(temp_mpz);
-				UNLOCK_GLOBALS;
+				CHECK(crunch_add_subscription(engine, sub_id, exponent_bits > INT_MAX ? -1 : (int)exponent_bits, buf));
 				break;
 			case 'a':
 				// Add a new entry into a subscription.
 				FILL(sub_id);
 				FILL(stream_id);
 				READ_FIELD; // Read in the base.
-				mpz_set_str(temp_mpz, buf, 16);
-//				gmp_printf("Adding entry: sub=%i stream=%i base=%Zd\n", sub_id, stream_id, temp_mpz);
-				WRITE_LOCK_GLOBALS;
-				// Make sure the sub_id is real.
-				if (global::subscriptions.count(sub_id) == 1) {
-					Subscription* sub = global::subscriptions[sub_id];
-					// Delete a previous entry, if it exists.
-					if (sub->entries.count(stream_id) == 1)
-						delete sub->entries[stream_id];
-					Entry* entry = sub->entries[stream_id] = new Entry(sub, temp_mpz);
-					// Issue a job to rebuild the table.
-
-					// Wait for a ready worker.
-					sem_wait(&global::workers_ready);
-					// Find a free slot.
-					for (int i = 0; i < global::thread_count; i++) {
-						JobSlot& js = global::job_slots[i];
-						if (js.ready_for_job) {
-							js.ready_for_job = false;
-							js.type = JOB_REBUILD;
-							js.to_rebuild = entry;
-							// Signal the thread to begin the job.
-							sem_post(&js.job_described);
-							goto job_assigned1;
-						}
-					}
-					assert("BUGBUGBUG: global::workers_ready semaphore was non-empty when no slot was free!" == NULL);
-					job_assigned1:;
-				}
-				UNLOCK_GLOBALS;
+				CHECK(crunch_add_entry(engine, sub_id, stream_id, buf));
+				tables_building = true;
 				break;
 			case 'd':
 				// Remove a subscription.
 				FILL(sub_id);
-				WRITE_LOCK_GLOBALS;
-				if (global::subscriptions.count(sub_id) == 1) {
-					delete global::subscriptions[sub_id];
-					global::subscriptions.erase(global::subscriptions.find(sub_id));
-				}
-				UNLOCK_GLOBALS;
+				CHECK(crunch_remove_subscription(engine, sub_id));
 				break;
-			case 'c': {
+			case 'c':
 				// Issue a computation.
 				FILL(stream_id);
 				FILL(round_number);
 				READ_FIELD; // Read in the datum.
-				mpz_set_str(temp_mpz, buf, 16);
-//				gmp_printf("Computation: stream=%i round=%i datum=%Zd\n", stream_id, round_number, temp_mpz);
-				// Create any new computation objects required.
-
-				// Increment the number of jobs in the given round, and create a semaphore for it.
-				if (global::round_semaphore.count(round_number) == 0) {
-					global::round_semaphore_waits[round_number] = 0;
-					assert(sem_init(&global::round_semaphore[round_number], 0, 0) == 0);
-				}
-				global::round_semaphore_waits[round_number]++; 
-
-				// If the given round does not yet exist, then we can freely add it.
-				bool have_lock = false;
-				if (global::computations.count(round_number) == 0) {
-					WRITE_LOCK_GLOBALS;
-					have_lock = true;
-				}
-				map<SubId, Computation*>& comps = global::computations[round_number];
-				if (have_lock)
-					UNLOCK_GLOBALS;
-				for (auto it = global::subscriptions.begin(); it != global::subscriptions.end(); it++) {
-					// Create a computation object for this subscription in this round number.
-					if (comps.count(it->first) == 0)
-						comps[it->first] = new Computation(it->second);
+				if (wait_for_tables && tables_building) {
+					crunch_wait_for_tables(engine);
+					tables_building = false;
 				}
-
-				// Wait for a ready worker.
-				sem_wait(&global::workers_ready);
-				// Find a free slot.
-				for (int i = 0; i < global::thread_count; i++) {
-					JobSlot& js = global::job_slots[i];
-					if (js.ready_for_job) {
-						js.ready_for_job = false;
-						js.type = JOB_COMP;
-						js.stream_id = stream_id;
-						js.round_number = round_number;
-						mpz_set(js.datum, temp_mpz);
-						// Signal the thread to begin the job.
-						sem_post(&js.job_described);
-						goto job_assigned2;
-					}
-				}
-				assert("BUGBUGBUG: global::workers_ready semaphore was non-empty when no slot was free!" == NULL);
-				job_assigned2:
+				CHECK(crunch_submit(engine, stream_id, round_number, buf));
 				break;
-			}
-			case 'r': {
-				// Read out completed answers.
+			case 'r':
+				// Ask for completed answers. The reply is queued now, and filled in when the round finishes.
 				FILL(round_number);
-//				gmp_printf("Replying: round=%lu\n", round_number);
-				// Wait until the round is done.
-				for (int i = 0; i < global::round_semaphore_waits[round_number]; i++) {
-					sem_wait(&global::round_semaphore[round_number]);
-				}
-
-				WRITE_LOCK_GLOBALS;
-				map<SubId, Computation*>& comps = global::computations[round_number];
-				uint64_t field = comps.size();
-//				gmp_printf("Lengths: %i %i\n", global::computations.size(), comps.size());
-				write(sockfd, &field, 8);
-				for (auto it = comps.begin(); it != comps.end(); it++) {
-					field = it->first;
-					write(sockfd, &field, 8);
-					it->second->produce_result(temp_mpz);
-					int bytes = gmp_snprintf(buf, READ_BUFFER_LENGTH, "%Zx", temp_mpz);
-					assert(bytes < READ_BUFFER_LENGTH);
-					write(sockfd, buf, bytes+1);
-					// Delete the allocation as we go, as we're done with the round.
-					delete it->second;
+				reply = queue_reply(now_us());
+				status = crunch_request_round(engine, round_number, round_finished, reply);
+				if (status != CRUNCH_OK) {
+					// The round was already requested; answer with zero fields, so the server's framing stays intact.
+					fprintf(stderr, "Command 'r' failed with status %i.\n", status);
+					mark_reply_ready(reply, (char*)calloc(1, 8), 8);
 				}
-				// Now we can clear out all the computations, storage, and semaphores for the round.
-				// Observe that if no computation was ever issued for a given round, default initializers
-				// will cause all the above code to still work. However, destroying a semaphore requires
-				// a greater degree of certainty. Therefore, do a check to see if we actually allocated one.
-				#define REMOVE_RN(x) x.erase(x.find(round_number))
-				if (global::round_semaphore.count(round_number) == 1) {
-					sem_destroy(&global::round_semaphore[round_number]);
-					REMOVE_RN(global::round_semaphore);
-					REMOVE_RN(global::round_semaphore_waits);
-				}
-				if (global::computations.count(round_number) == 1) {
-					REMOVE_RN(global::computations);
-				}
-				#undef REMOVE_RN
-				UNLOCK_GLOBALS;
 				break;
-			}
 			case 'i':
 				// Return status information.
-				write(sockfd, "1\n", 2);
+				mark_reply_ready(queue_reply(0), strdup("1\n"), 2);
 				break;
 			default:
 				fprintf(stderr, "Got invalid command character: %i\n", type);
@@ -557,8 +533,45 @@ int main(int argc, char** argv) {
 		}
 	}
 
+	hangup:
+	// Builds still running now raced the computations after them, which then ran without their tables.
+	int pending_tables = crunch_pending_tables(engine);
+	// Let the writer flush every outstanding reply before hanging up.
+	pthread_mutex_lock(&global::replies_mutex);
+	global::closing = true;
+	pthread_cond_broadcast(&global::replies_cond);
+	pthread_mutex_unlock(&global::replies_mutex);
+	pthread_join(writer, NULL);
+
+	// Report throughput over the whole session, from the first chunk in to the last reply ready.
+	double elapsed = (max(global::last_ready_us, now_us()) - input->start_us) * 1e-6;
+	printf("Commands: s=%lu a=%lu d=%lu c=%lu r=%lu i=%lu in %.3f s (%.1f datums/s)\n",
+		command_counts['s'], command_counts['a'], command_counts['d'], command_counts['c'], command_counts['r'], command_counts['i'],
+		elapsed, command_counts['c'] / elapsed);
+	vector<uint64_t>& latencies = global::round_latencies_us;
+	if (latencies.size() > 0) {
+		sort(latencies.begin(), latencies.end());
+		double total = 0;
+		for (size_t i = 0; i < latencies.size(); i++)
+			total += latencies[i];
+		printf("Round latency (ms) over %zu rounds: mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n", latencies.size(),
+			total / latencies.size() * 1e-3, latencies[latencies.size() / 2] * 1e-3,
+			latencies[latencies.size() * 99 / 100] * 1e-3, latencies.back() * 1e-3);
+	}
+	char stats[1024];
+	crunch_stats(engine, stats, sizeof stats);
+	if (global::write_failed)
+		printf("Dropped %lu replies after the connection failed.\n", global::dropped_replies);
+	printf("Tables at exit:\n%s", stats);
+	printf("Table builds still pending at hangup: %i\n", pending_tables);
 	printf("Exiting.\n");
 	close(sockfd);
+	if (input->capture != NULL)
+		fclose(input->capture);
+	if (input->replay != NULL && input->replay != stdin)
+		fclose(input->replay);
+	delete input;
+	crunch_engine_free(engine);
+	delete[] buf;
 	return 0;
 }
-
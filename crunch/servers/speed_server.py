@@ -32,7 +32,7 @@ start_time = time.time()
 print "Connected by", addr
 for i in xrange(SUB_COUNT):
 	print "Filling sub:", i+1
-	S("s", i, Z(random.getrandbits(2047)))
+	S("s", i, 2048, Z(random.getrandbits(2047)))
 	for j in xrange(STREAM_COUNT):
 		S("a", i, 1000+j, Z(random.getrandbits(2047)))
 print "Sending computations."
@@ -1,34 +1,123 @@
 #! /usr/bin/python
+# Checks the cruncher's results against Python's pow(), once for each acceleration table format.
+# Run from anywhere after building (or with make test); the cruncher binary is taken from the directory above
+# this script. An optional argument seeds the random numbers.
+
+from __future__ import print_function
+import os, random, socket, struct, subprocess, sys
+
+CRUNCHER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "cruncher")
+
+# Each configuration is the table options the cruncher is run with. -W makes every table get used.
+CONFIGS = [
+	[],
+	["-z", "4"],
+	["-f", "signed", "-z", "1"],
+	["-f", "signed", "-z", "5"],
+	["-f", "comb", "-z", "4", "-b", "3"],
+	# More blocks than the exponent has bits, which the engine clamps.
+	["-f", "comb", "-z", "3", "-b", "1000"],
+]
+# Subscription exponent widths, where zero means the width of the modulus.
+WIDTHS = [0, 1024, 100]
+MODULUS_BITS = 512
+STREAMS, ROUNDS = 6, 4
+
+class Connection:
+	def __init__(self, options):
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		s.bind(("127.0.0.1", 0))
+		s.listen(1)
+		self.process = subprocess.Popen([CRUNCHER, "-t", "3", "-W"] + options + ["127.0.0.1", str(s.getsockname()[1])],
+			stdout=open(os.devnull, "w"))
+		self.conn, addr = s.accept()
+		s.close()
+		self.fd = self.conn.makefile("rwb")
+
+	def S(self, *x):
+		self.fd.write(b"".join(struct.pack("<q", i) if isinstance(i, int) else i.encode("ascii") for i in x))
+		self.fd.flush()
+
+	def read_results(self):
+		count, = struct.unpack("<q", self.fd.read(8))
+		results = []
+		for i in range(count):
+			sub, = struct.unpack("<q", self.fd.read(8))
+			s = b""
+			while not s.endswith(b"\0"): s += self.fd.read(1)
+			results.append((sub, int(s[:-1], 16)))
+		return results
+
+	def close(self):
+		# The makefile holds the socket open too, so close it first for the cruncher to see the hangup.
+		self.fd.close()
+		self.conn.close()
+		return self.process.wait()
 
-import socket, struct, time
-
-s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-s.bind(("", 50002))
-s.listen(1)
-conn, addr = s.accept()
-fd = conn.makefile()
-def S(*x):
-	msg = "".join(struct.pack("<q", i) if isinstance(i, int) else i for i in x)
-	print "Sending:", repr(msg)
-	fd.write(msg)
-	fd.flush()
 def Z(x):
 	return "%x" % x + "\0"
-def read_results():
-	count, = struct.unpack("<q", fd.read(8))
-	results = []
-	for i in xrange(count):
-		sub, = struct.unpack("<q", fd.read(8))
-		s = ""
-		while not s.endswith("\0"): s += fd.read(1)
-		results.append((sub, int(s[:-1], 16)))
-	return results
-print "Connected by", addr
-S("s", 1, Z(1000))
-S("a", 1, 2, Z(2))
-S("c", 2, 3, Z(4)) 
-S("r", 3)
-print read_results()
-conn.close()
 
+def gcd(a, b):
+	while b:
+		a, b = b, a % b
+	return a
+
+def check(options):
+	c = Connection(options)
+	failures = 0
+	# The smallest possible session.
+	c.S("s", 1000, 0, Z(1000))
+	c.S("a", 1000, 2, Z(2))
+	c.S("c", 2, 3, Z(4))
+	c.S("r", 3)
+	if c.read_results() != [(1000, 16)]:
+		print("  FAIL: 2^4 mod 1000")
+		failures += 1
+	c.S("d", 1000)
+
+	# Random moduli, all multiples of 3, and bases prime to them, except for the first stream's, which shares
+	# the factor 3 (and so gets a window table in place of a signed one). The last stream is left out of some
+	# subscriptions.
+	mods = [3 * (random.getrandbits(MODULUS_BITS - 2) | (1 << (MODULUS_BITS - 3)) | 1) for width in WIDTHS]
+	bases = {}
+	for i, width in enumerate(WIDTHS):
+		c.S("s", i, width, Z(mods[i]))
+		for j in range(STREAMS):
+			if j != STREAMS - 1 or random.random() < 0.5:
+				base = 3 * random.randrange(1, mods[i] // 3)
+				while j != 0 and gcd(base, mods[i]) != 1:
+					base = random.randrange(2, mods[i])
+				bases[i, j] = base
+				c.S("a", i, 100 + j, Z(base))
+	# The first round reads the edge cases: zero, all ones up to each subscription's width (which carries out
+	# of the top digit of signed tables), and wider than some subscriptions allow. Later rounds are random.
+	edges = [0, (1 << MODULUS_BITS) - 1, (1 << 1024) - 1, (1 << 100) - 1, (1 << 1100) - 1]
+	data = {}
+	for r in range(ROUNDS):
+		for j in range(STREAMS):
+			data[r, j] = edges[j % len(edges)] if r == 0 else random.getrandbits(random.randint(1, 1100))
+			c.S("c", 100 + j, r, Z(data[r, j]))
+	for r in range(ROUNDS):
+		c.S("r", r)
+	for r in range(ROUNDS):
+		results = dict(c.read_results())
+		for i in range(len(WIDTHS)):
+			expected = 1
+			for j in range(STREAMS):
+				if (i, j) in bases:
+					expected = expected * pow(bases[i, j], data[r, j], mods[i]) % mods[i]
+			if results.get(i) != expected:
+				print("  FAIL: round %i, subscription of width %i" % (r, WIDTHS[i]))
+				failures += 1
+	if c.close() != 0:
+		print("  FAIL: cruncher exited with status %i" % c.process.returncode)
+		failures += 1
+	return failures
+
+random.seed(int(sys.argv[1]) if len(sys.argv) > 1 else 1)
+failures = 0
+for options in CONFIGS:
+	print("Checking:", " ".join(options) or "no tables")
+	failures += check(options)
+print("%i failures" % failures)
+sys.exit(1 if failures else 0)